@@ -0,0 +1,2407 @@
+
+#include "calc_engine.h"
+#include "consolecalc.h"
+#include <stdexcept>
+#include <cassert>      
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <math.h>
+#include <cmath>
+#include <thread>
+#include <limits>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+    // could define these constants as well, but I prefer the variables for the user-facing system constants
+    // long double so the wider engines don't lose precision, each engine narrows them to its own type
+const long double e = 2.718281828459045235360287L;     
+const long double g = 9.80665L;       // gravitational constant
+const long double phi = 1.618033988749894848204587L;
+const long double pi = 3.141592653589793238462643L;
+template<typename Num>
+const Num syscons[NUM_SYSVAR] = {Num(e),Num(g),Num(phi),Num(pi)};
+// if extending system constants, list constants first in reservedVarNames, then all commands, then all options/targets
+// plain char arrays rather than std::string so nothing needs constructing at startup
+const char* const reservedVarNames[NUM_SYSVAR+NUM_COMMAND+NUM_OPTIONS] = {"e","g","phi","pi",     "help","q","quit","delete","display","publish","def","sum","prod","min","max",        "sysvars","uvars","all","operators","shared","memory","functions"}; 
+const char operators[NUM_OP] = {'(',')',';','=','+','-','*','/','%','^',','};
+const char* const opdescrip[NUM_OP] = {"Open parentheses","Close parentheses","Print","Assign a user variable","Add","Subtract/Negative","Multiply","Divide","Modulo","Power/Raise","Separate function parameters/arguments"};
+
+char const helptext[] = "Symbols and commands: \n ; - Use to signify the end of a single expression and parse all input \n q or quit - Quit program \n help; - Display this help text \n display sysvars; - Display a list of built in system variables \n display uvars; - Display a list of current user variables \n display all; - Display a list of all current variables \n display operators; - Display a list of accepted operators \n delete uvars all; - Delete all current user variables \n delete uvars $name; - Delete user variable with name matching $name \n publish $name = ($expression); - Publish a constant to the namespace shared by all sessions \n display shared; - Display the published shared constants \n display memory; - Display memory used by user variables \n def $name($params) = ($expression); - Define a function, e.g. def f(x,y) = ((x-y)*(x-y)); then f(a,2); \n display functions; - Display the user functions \n sum(i, $from, $to, $expression), also prod, min and max - Reduce the expression over i = from, from+1, ... to \n sum(i, $from, $to, $step, $expression) - The same with i going up (or down) by step \n\n User variables must include only alpha characters.\n\n User Variable names are case sensitive, system constants and commands are not. \n To assign a variable, use 'varname = ($expression);'\n\n";
+
+// which reduction a reduce token is
+const int REDUCE_SUM = 0;
+const int REDUCE_PROD = 1;
+const int REDUCE_MIN = 2;
+const int REDUCE_MAX = 3;
+
+// helper functions
+const std::string lowcase(const std::string str);   // creates a lowercase string of input
+bool is_op(const char ch);                         // checks if ch is an operator character
+bool is_sysvar(const std::string varName);          // checks if varName is a system constant
+template<typename Num>
+const Num get_sysvar(const std::string varName);    // returns value of matching system constant
+bool is_command(const std::string varName);         // checks if varName is a command
+bool is_option(const std::string varName);          // checks if varName is a valid option/target
+double get_option(const std::string varName);       // returns the appropriate option value for tokens
+bool is_break(const char ch);                       // checks if ch is a break character
+std::string read_name(std::istream& in);            // reads a name, the letters after any whitespace
+
+// small helpers to check for and get user variables out of a session's variable list
+template<typename Num>
+bool is_usrvar(const uservar_table<Num>& vars, const std::string varName);      // checks is user variable varName exists
+template<typename Num>
+const Num get_usrvar(const uservar_table<Num>& vars, const std::string varName); // gets value of matching user variable
+template<typename Num>
+long find_function(const std::vector<user_function<Num>>& funcs, const std::string name);  // index of the newest function name, -1 if none
+
+
+template<typename Num>
+void token_stream<Num>::putback(token<Num> t)
+{
+    if (full)
+        throw std::runtime_error("putback() into a full buffer");
+    buffer = t;
+    full = true;
+}
+
+template<typename Num>
+token<Num> token_stream<Num>::get()    // read a token from the token_stream
+{
+    // check if we already have a Token ready
+    if (full)
+    {
+        full = false;
+        return buffer;
+    }
+    if (!timed)
+        return read();
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        token<Num> t = read();
+        lexed += std::chrono::steady_clock::now()-start;
+        return t;
+    }
+    catch (...)
+    {
+        lexed += std::chrono::steady_clock::now()-start;
+        throw;
+    }
+}
+
+template<typename Num>
+token<Num> token_stream<Num>::read()    // lex a new token from the input
+{
+    // note that >> skips whitespace (space, newline, tab, etc.)
+    char ch;      // ch for cin
+    std::string vrname, optname; // for constructing names
+    vrname.clear();
+    optname.clear();
+    *in >> ch;
+    if (!*in)           // end of input ends the session the same as 'q', value 1 tells them apart
+        return token<Num>(quit,1);
+
+    // operator check
+    if (is_op(ch))    // is an operator 
+        return token<Num>(ch);
+    if (is_break(ch))   // from cin, can't be ' ', all other breaks should cause print tokens
+        return token<Num>(print);
+
+    // now numbers
+    if (isdigit(ch) || ch=='.')
+    {
+        in->putback(ch);
+        Num val;
+        *in >> val;
+        return token<Num>(val);
+    }
+
+    if (isalpha(ch)) // starts with character, either existing variable or assign
+    {
+        in->putback(ch);
+        vrname = read_name(*in);
+        if (is_command(lowcase(vrname))) // a command
+        {
+            std::string cmnd = lowcase(vrname);
+            if (cmnd=="q"||cmnd=="quit")
+            {
+                return token<Num>(quit);
+            }
+            if (cmnd=="help")
+            {
+                return token<Num>(help);
+            }
+            if (cmnd=="display")
+            {
+                optname = read_name(*in);     // continue to check command target
+                std::string tgt = lowcase(optname);
+                if (is_option(tgt))
+                {
+                    Num flag = get_option(tgt);
+                    return token<Num>(disp,flag);
+                }
+                throw std::runtime_error("Bad argument for display. Options for display are: sysvars;  uvars;  all;  options;");
+            }
+            if (cmnd=="delete")
+            {
+                optname = read_name(*in);     // continue to check command target
+                std::string tgt = lowcase(optname);
+                if (tgt=="all")
+                    return token<Num>(del,-1);
+                else if (is_usrvar(vars, optname))    // a matching variable exists
+                    return token<Num>(del,0,optname);
+                else
+                    throw std::runtime_error("Cannot delete a variable that does not exist!");
+            }
+            if (cmnd=="publish")
+            {
+                optname = read_name(*in);     // continue to read the name being published
+                std::string lname = lowcase(optname);
+                if (optname.empty() || is_sysvar(lname) || is_command(lname) || is_option(lname))
+                    throw std::runtime_error("Bad name to publish. Use: publish name = ($expression);");
+                ch = 0;
+                *in >> ch;
+                if (ch!='=')
+                {
+                    in->putback(ch);
+                    throw std::runtime_error("Expected '=' after the name to publish");
+                }
+                return token<Num>(pub,0,optname);
+            }
+            if (cmnd=="sum" || cmnd=="prod" || cmnd=="min" || cmnd=="max")
+            {
+                int which = cmnd=="sum" ? REDUCE_SUM : cmnd=="prod" ? REDUCE_PROD : cmnd=="min" ? REDUCE_MIN : REDUCE_MAX;
+                return token<Num>(reduce,which);
+            }
+            if (cmnd=="def")
+            {
+                optname = read_name(*in);     // continue to read the name being defined, the session reads the rest
+                std::string lname = lowcase(optname);
+                if (optname.empty() || is_sysvar(lname) || is_command(lname) || is_option(lname))
+                    throw std::runtime_error("Bad function name. Use: def name(x,y) = ($expression);");
+                if (is_usrvar(vars, optname))
+                    throw std::runtime_error("Cannot define a function with the name of a user variable");
+                return token<Num>(fdef,0,optname);
+            }
+            // command not in list
+            throw std::runtime_error("Command not found.");
+        }
+        if (is_sysvar(lowcase(vrname))) // a system constant exists
+        {
+            Num d = get_sysvar<Num>(lowcase(vrname));
+            return token<Num>(d);   // resolve constants into number tokens
+        }
+        if (params!=nullptr)    // compiling a function body, its parameters become frame slots
+        {
+            for (size_t i=0; i<params->size(); i++)
+            {
+                if ((*params)[i]==vrname)
+                    return token<Num>(fparam,i);
+            }
+        }
+        long f = find_function(funcs, vrname);
+        if (f>=0)               // a user function, the caller reads the arguments
+            return token<Num>(fcall,f,vrname);
+        if (is_usrvar(vars, vrname))      // one exists
+        {
+            *in >> ch;
+            if (ch=='=')        // gonna assign, make a setvar
+            {
+                return token<Num>(setvar, 1, vrname); // set 1 to take from expression, 0 to 0
+            }
+            else                // just make a number from its value
+            {
+                in->putback(ch);
+                Num d = get_usrvar(vars, vrname);
+                return token<Num>(d);
+            }
+        }
+        Num shv;
+        if (get_shared(vrname, shv))      // a published constant, user variables shadow these
+        {
+            ch = 0;
+            *in >> ch;
+            if (ch=='=')        // assigning creates a user variable of the same name
+                return token<Num>(setvar, 1, vrname);
+            in->putback(ch);
+            return token<Num>(shv);
+        }
+        ch = 0; // set to allow end of line to declare new var, e.g. "prompt> var" then enter creates var with value 0
+        *in >> ch; // unitiatied variable, check if assign, print, or nothing after, latter 2 set to zero
+        if (ch==0||ch==';')
+        {    // create the user variable with initial value 0
+            return token<Num>(setvar,0,vrname);
+        }
+        else if (ch=='=')  // create then assign
+            return token<Num>(setvar,1,vrname);
+        else  // trying to use an undeclared variable
+        {
+            in->putback(ch);
+            throw std::runtime_error("Tried to use an undeclared variable!");
+        }
+    }
+    // should only get here if character or token is unmakeable
+    throw std::runtime_error("Bad token");    
+}
+
+
+// discard print tokens before the next statement, leaving its first character unread. A ';' in the
+// buffer goes too, any other buffered token is the next statement's start and is kept
+template<typename Num>
+void token_stream<Num>::skip_prints()
+{
+    if (full)
+    {
+        if (buffer.kind()!=print)
+            return;
+        full = false;
+    }
+    char ch = 0;
+    while (*in >> ch)       // >> skips the whitespace
+    {
+        if (ch!=';')
+        {
+            in->putback(ch);
+            return;
+        }
+    }
+}
+
+// discard tokens up to and including a c
+template<typename Num>
+void token_stream<Num>::ignore(char c)
+{
+    // first look in buffer:
+    if (full && c == buffer.kind())    // && means 'and'
+    {
+        full = false;
+        return;
+    }
+    full = false;    // discard the contents of buffer
+
+    // now search input:
+    char ch = 0;
+    while (in->get(ch))
+    {
+        if (ch == c)
+            break;
+    }
+}
+
+
+
+template<typename Num>
+Num calculator<Num>::primary()    // Number or ‘(‘ Expression ‘)’ or '-' for negative numbers, or search/set user var. power '^' also managed here 
+{
+    char ch;       // for negative usage
+    std::string varname; // for checking existing user variables
+    tick();         // every primary counts against the statement's budget
+    token<Num> t = ts.get();
+    token<Num> n;   // to use when checking for - or ^
+    std::istream& in = ts.input();  // the negative branches read characters directly
+    Num shv;        // for negated published constants
+    long fi;        // for negated user function calls
+    switch (t.kind())
+    {
+        case '(':    // handle ‘(’expression ‘)’
+        {
+            Num d = expression();
+            t = ts.get();
+            if (t.kind() != ')')
+                throw std::runtime_error("')' expected");
+            return d;
+            break;          // unnecessary but safe
+        }
+        case '-':   // check if folowing token would be number, if so, read in then make negative
+        {
+            in >> ch;
+            if (ch=='(')
+            {
+                Num d = expression();
+                t = ts.get();
+                if (t.kind() != ')')
+                    throw std::runtime_error("')' expected");
+                return d*-1;
+                break;          // unnecessary but safe
+            }
+            if (isdigit(ch) || ch=='.') // next token will be number
+            {
+                in.putback(ch);     // replace ch, read in double, then negate and return
+                Num dn;
+                in >> dn;
+                dn *= -1;               // negate        
+                in >> ch;          // now we have a number, must check for power ^
+                if (ch=='^')      // is a raise ^
+                {
+                    Num rpower = primary();      // evaluate the primary to be raised to
+                    Num result = pow(dn, rpower);   // then raise value to power
+                    return result;      // return, closed out
+                }
+                else                   // not a raise ^
+                {
+                    in.putback(ch);      // put next token into buffer
+                    return dn;          // return, closed out
+                }
+            }
+            else if (isalpha(ch))       // could be user variable
+            {
+                in.putback(ch);
+                varname = read_name(in);
+                // First check if varname is a command, if so throw error
+                if (is_command(varname))
+                    throw std::runtime_error("Tried to create primary from command name");
+                // Now to check if variable exists, otherwise throw error
+                if (is_sysvar(varname))     // is a system constant, so get its value then negate
+                    return negated_power(get_sysvar<Num>(varname));
+                // Now check for user var, if not that either then throw error
+                else if (is_usrvar(userVars, varname))    // there is an existing uservar, get its value then negate
+                    return negated_power(get_usrvar(userVars, varname));
+                // Then a user function, its value negated
+                else if ((fi = find_function(functions, varname))>=0)
+                    return negated_power(call_function(fi));
+                // Last a published constant in the shared namespace
+                else if (ts.get_shared(varname, shv))
+                    return negated_power(shv);
+                else
+                    throw std::runtime_error("Failed to create a negative primary from alpha chars");
+            }
+            break;          // unnecessary but safe
+        }
+        case number:    // since we allow power, we must check for next char being ^
+        {
+            n = ts.get();   // get next token to check for power to preserve precedence
+            if (n.kind()=='^')  // next operator is a raise, must raise to an primary
+            {
+                in >> std::ws;
+                Num rpower = primary();             // evaluate the primary to be raised to
+                Num result = pow(t.value(), rpower);   // then raise value to power
+                return result;
+            }
+            else        // not a power, treat as normal number
+            {
+                ts.putback(n);       // pushback the token
+                return t.value();    // return the number’s value
+            }
+            break;          // unnecessary but safe
+        }
+        case reduce:    // sum, prod, min or max over a range, also like a number
+        {
+            Num rv = reduction(t.value());
+            n = ts.get();
+            if (n.kind()=='^')
+            {
+                Num rpower = primary();
+                return pow(rv, rpower);
+            }
+            ts.putback(n);
+            return rv;
+        }
+        case fcall:     // user function, like a number its value may be raised to a power
+        {
+            Num fv = call_function(t.value());
+            n = ts.get();
+            if (n.kind()=='^')
+            {
+                Num rpower = primary();
+                return pow(fv, rpower);
+            }
+            ts.putback(n);
+            return fv;
+        }
+        case setvar:    // if valid user variable
+        {
+            return t.value();
+            break;          // unnecessary but safe
+        }
+        default:
+        {
+            if (out!=nullptr)
+                *out << "Hit default in primary with token " << t.kind() << " " << t.value() << " " << t.getname() << std::endl;
+            throw std::runtime_error("primary expected");
+        }
+    }
+    // should only reach here if everything failed, throw error
+    throw std::runtime_error("Reached bottom of primary, something very wrong.");
+}
+
+// the negative of a name's value in primary(), with a '^' after it the negated value is raised to the next primary
+template<typename Num>
+Num calculator<Num>::negated_power(Num v)
+{
+    v *= -1;
+    token<Num> n = ts.get();    // now we have a number, must check for power ^
+    if (n.kind()=='^')
+        return pow(v, primary());
+    ts.putback(n);      // not a raise, put the token back
+    return v;
+}
+
+// exactly like expression(), but for '*', '/', '%', and '^'
+template<typename Num>
+Num calculator<Num>::term()
+{
+    Num left = primary();    // get the Primary
+    while (true)
+    {
+        token<Num> t = ts.get();    // get the next Token ...
+        switch (t.kind())
+        {
+        case '*':
+            left *= primary();
+            break;
+        case '/':
+        {
+            Num d = primary();
+            if (d == 0)
+                throw std::runtime_error("divide by zero");
+            left /= d;
+            break;
+        }
+        case '%':       // can't modulo doubles, so I'll just do it manually
+            left = modulo(left, primary(), steps);
+            break;
+        case '^':
+        {
+            Num d = primary();
+            left = pow(left,d);
+            return left;
+        }
+        default:
+            ts.putback(t);    // <<< put the unused token back
+            return left;      // return the value
+        }
+    }
+}
+
+// read and evaluate: 1   1+2.5   1+2+3.14  etc.
+// 	 return the sum (or difference)
+template<typename Num>
+Num calculator<Num>::expression()
+{
+    Num left = term();    // get the Term
+    while (true)
+    {
+        token<Num> t = ts.get();    // get the next token…
+        switch (t.kind())      // ... and do the right thing with it
+        {
+        case '+':
+            left += term();
+            break;
+        case '-':
+            left -= term();
+            break;
+        default:
+            ts.putback(t);    // <<< put the unused token back
+            return left;      // return the value of the expression
+        }
+    }
+}
+
+template<typename Num>
+void calculator<Num>::clean_up_mess()
+{
+    ts.ignore(print); 
+}
+
+// left % d for the '%' operator and compiled code, can't modulo doubles, so I'll just do it manually
+template<typename Num>
+Num calculator<Num>::modulo(Num left, Num d, step_meter& m)
+{
+    if (d==0)
+        throw std::runtime_error("modulo by zero");
+    if (left==0)    // 0 mod anything is still zero
+        return left;
+    if (left<0)     // left side negative
+    {
+        if (d<0)    // both negative
+        {
+            while (left<=d)
+            {
+                tick(m);
+                left-=d;    // both negative, will range between (d,0]
+            }
+        }
+        else        // right side positive
+        {
+            while (left+d<=0)
+            {
+                tick(m);
+                left +=d;
+            }
+        }
+    }
+    else            // left side positive
+    {
+        if (d<0)    // right side negative
+        {
+            while (left>0)
+            {
+                tick(m);
+                left+=d;    // will range between (d,0] 
+            }
+        }
+        else        // both positive, trivial case
+        {
+            while (left>=d)
+            {
+                tick(m);
+                left -=d;
+            }
+        }
+    }
+    return left;
+}
+
+// how many instructions a body may have and still be inlined into its callers
+const size_t INLINE_MAX_OPS = 24;
+// slots in a session's call stack, a function whose calls would need more is refused at its def
+const size_t CALL_STACK_SLOTS = 4096;
+
+// read "(x,y) = (expression)" after 'def name' and compile the body into a new function
+// other variables in the body are taken at their value now, functions at their current definition
+template<typename Num>
+void calculator<Num>::define(const std::string& name)
+{
+    std::istream& in = ts.input();
+    user_function<Num> fn;
+    fn.name = name;
+    char ch = 0;
+    in >> ch;
+    if (ch!='(')
+    {
+        in.putback(ch);
+        throw std::runtime_error("Expected '(' and a parameter list after the function name");
+    }
+    ch = 0;
+    in >> ch;
+    while (ch!=')')
+    {
+        in.putback(ch);
+        std::string pname = read_name(in);
+        ch = 0;
+        in >> ch;       // the ',' or ')' after it
+        std::string lname = lowcase(pname);
+        if (pname.empty() || is_sysvar(lname) || is_command(lname) || is_option(lname)
+            || std::find(fn.params.begin(), fn.params.end(), pname)!=fn.params.end())
+        {
+            in.putback(ch);
+            throw std::runtime_error("Bad parameter name, parameters are distinct alpha names that aren't reserved");
+        }
+        fn.params.push_back(pname);
+        if (ch==',')
+        {
+            ch = 0;
+            in >> ch;
+        }
+        else if (ch!=')')
+        {
+            in.putback(ch);
+            throw std::runtime_error("Expected ',' or ')' in the parameter list");
+        }
+    }
+    ch = 0;
+    in >> ch;
+    if (ch!='=')
+    {
+        in.putback(ch);
+        throw std::runtime_error("Expected '=' after the parameter list");
+    }
+    codegen cg = {{}, fn.params.size(), 0, fn.params.size()};
+    ts.params = &fn.params;
+    try
+    {
+        compile_expression(cg);
+    }
+    catch (...)
+    {
+        ts.params = nullptr;
+        throw;
+    }
+    ts.params = nullptr;
+    fn.code = cg.code;
+    fn.need = select_kernels(fn.code, fn.params.size());
+    if (fn.need>CALL_STACK_SLOTS)
+        throw std::runtime_error("Function calls nested too deeply for the call stack");
+    if (callstack.empty())
+        callstack.resize(CALL_STACK_SLOTS);
+    functions.push_back(fn);
+}
+
+// the compile_ functions follow primary(), term() and expression() token for token, so a body
+// computes what the same text would as a statement, except where select_kernels() saves a rounding
+
+template<typename Num>
+void calculator<Num>::compile_primary(codegen& cg)
+{
+    token<Num> t = ts.get();
+    switch (t.kind())
+    {
+        case '(':
+        {
+            compile_expression(cg);
+            t = ts.get();
+            if (t.kind() != ')')
+                throw std::runtime_error("')' expected");
+            return;
+        }
+        case '-':   // negated group, number, parameter or call, all but the group may be raised to a power
+        {
+            t = ts.get();
+            switch (t.kind())
+            {
+                case '(':
+                {
+                    compile_expression(cg);
+                    t = ts.get();
+                    if (t.kind() != ')')
+                        throw std::runtime_error("')' expected");
+                    emit(cg, op_neg);
+                    return;
+                }
+                case number:
+                    emit(cg, op_push, 0, t.value()*-1);
+                    compile_power(cg);
+                    return;
+                case fparam:
+                    emit(cg, op_arg, t.value());
+                    emit(cg, op_neg);
+                    compile_power(cg);
+                    return;
+                case fcall:
+                    compile_call(cg, t.value());
+                    emit(cg, op_neg);
+                    compile_power(cg);
+                    return;
+            }
+            throw std::runtime_error("Failed to create a negative primary");
+        }
+        case number:
+            emit(cg, op_push, 0, t.value());
+            compile_power(cg);
+            return;
+        case fparam:
+            emit(cg, op_arg, t.value());
+            compile_power(cg);
+            return;
+        case fcall:
+            compile_call(cg, t.value());
+            compile_power(cg);
+            return;
+        case reduce:
+            throw std::runtime_error("sum, prod, min and max can't be used in a function body or another reduction");
+    }
+    throw std::runtime_error("primary expected");
+}
+
+template<typename Num>
+void calculator<Num>::compile_power(codegen& cg)
+{
+    token<Num> n = ts.get();
+    if (n.kind()=='^')
+    {
+        compile_primary(cg);
+        emit(cg, op_pow);
+    }
+    else
+        ts.putback(n);
+}
+
+template<typename Num>
+void calculator<Num>::compile_term(codegen& cg)
+{
+    compile_primary(cg);
+    while (true)
+    {
+        token<Num> t = ts.get();
+        switch (t.kind())
+        {
+        case '*':
+            compile_primary(cg);
+            emit(cg, op_mul);
+            break;
+        case '/':
+            compile_primary(cg);
+            emit(cg, op_div);
+            break;
+        case '%':
+            compile_primary(cg);
+            emit(cg, op_mod);
+            break;
+        case '^':
+            compile_primary(cg);
+            emit(cg, op_pow);
+            return;
+        default:
+            ts.putback(t);
+            return;
+        }
+    }
+}
+
+template<typename Num>
+void calculator<Num>::compile_expression(codegen& cg)
+{
+    compile_term(cg);
+    while (true)
+    {
+        token<Num> t = ts.get();
+        switch (t.kind())
+        {
+        case '+':
+            compile_term(cg);
+            emit(cg, op_add);
+            break;
+        case '-':
+            compile_term(cg);
+            emit(cg, op_sub);
+            break;
+        default:
+            ts.putback(t);
+            return;
+        }
+    }
+}
+
+// "(args)" of a call of function f. Each argument is compiled on its own first: when the body is small
+// and every argument is a single constant or parameter, they are substituted into a copy of the body
+// and nothing is pushed. Otherwise the arguments are pushed and a small body is copied in reading them
+// from the stack, or a larger one is called
+template<typename Num>
+void calculator<Num>::compile_call(codegen& cg, size_t f)
+{
+    const user_function<Num>& callee = functions[f];
+    size_t nargs = callee.params.size();
+    token<Num> t = ts.get();
+    if (t.kind()!='(')
+        throw std::runtime_error("'(' expected after function name");
+    std::vector<codegen> args;
+    t = ts.get();
+    if (t.kind()!=')')
+    {
+        ts.putback(t);
+        while (true)
+        {
+            codegen arg = {{}, cg.nparams, cg.depth+args.size(), cg.need};  // compiled where it will be pushed
+            compile_expression(arg);
+            cg.need = std::max(cg.need, arg.need);
+            args.push_back(arg);
+            t = ts.get();
+            if (t.kind()==')')
+                break;
+            if (t.kind()!=',')
+                throw std::runtime_error("',' or ')' expected in function arguments");
+        }
+    }
+    if (args.size()!=nargs)
+        throw std::runtime_error("Function "+callee.name+" expects "+std::to_string(nargs)+" arguments");
+
+    bool simple = true;
+    for (size_t i=0; i<nargs; i++)
+    {
+        if (args[i].code.size()!=1 || (args[i].code[0].op!=op_push && args[i].code[0].op!=op_arg))
+            simple = false;
+    }
+    size_t base = cg.nparams+cg.depth;  // frame slot the callee's frame would start at
+    if (callee.code.size()<=INLINE_MAX_OPS && simple)
+    {
+        for (size_t i=0; i<callee.code.size(); i++)
+        {
+            const instr<Num>& in = callee.code[i];
+            if (in.op==op_arg && in.a<nargs)
+                emit(cg, args[in.a].code[0].op, args[in.a].code[0].a, args[in.a].code[0].value);
+            else if (in.op==op_arg)     // a temporary of the callee, it has no argument slots here
+                emit(cg, op_arg, base+in.a-nargs);
+            else
+                emit(cg, in.op, in.a, in.value);
+        }
+        return;
+    }
+    for (size_t i=0; i<nargs; i++)
+    {
+        for (size_t k=0; k<args[i].code.size(); k++)
+            emit(cg, args[i].code[k].op, args[i].code[k].a, args[i].code[k].value);
+    }
+    if (callee.code.size()<=INLINE_MAX_OPS)
+    {
+        for (size_t i=0; i<callee.code.size(); i++)
+        {
+            const instr<Num>& in = callee.code[i];
+            emit(cg, in.op, in.op==op_arg ? base+in.a : in.a, in.value);
+        }
+        if (nargs>0)
+            emit(cg, op_drop, nargs);
+        return;
+    }
+    emit(cg, op_call, f);
+}
+
+// append an instruction, keeping track of the stack depth. Operators on constants are folded
+// into a constant, except division and modulo by zero which are left to fail when run
+template<typename Num>
+void calculator<Num>::emit(codegen& cg, opcode op, unsigned a, Num value)
+{
+    std::vector<instr<Num>>& code = cg.code;
+    size_t n = code.size();
+    if (op>=op_add && op<=op_pow && n>=2 && code[n-1].op==op_push && code[n-2].op==op_push
+        && !((op==op_div || op==op_mod) && code[n-1].value==0))
+    {
+        Num left = code[n-2].value;
+        Num right = code[n-1].value;
+        switch (op)
+        {
+            case op_add: left += right; break;
+            case op_sub: left -= right; break;
+            case op_mul: left *= right; break;
+            case op_div: left /= right; break;
+            case op_mod: left = modulo(left, right, steps); break;
+            default: left = pow(left, right); break;
+        }
+        code.pop_back();
+        code.back().value = left;
+        cg.depth--;
+        return;
+    }
+    if (op==op_neg && n>=1 && code[n-1].op==op_push)
+    {
+        code.back().value *= -1;
+        return;
+    }
+    code.push_back({op, a, value});
+    switch (op)
+    {
+        case op_push:
+        case op_arg:
+            cg.depth++;
+            break;
+        case op_neg:
+        case op_square:
+        case op_recip:
+            break;
+        case op_muladd:
+        case op_mulsub:
+        case op_addmul:
+        case op_submul:
+            cg.depth -= 2;
+            break;
+        case op_call:
+        {
+            size_t nargs = functions[a].params.size();
+            cg.need = std::max(cg.need, cg.nparams+cg.depth-nargs+functions[a].need);
+            cg.depth = cg.depth-nargs+1;
+            break;
+        }
+        case op_drop:
+            cg.depth -= a;
+            break;
+        default:    // binary operators
+            cg.depth--;
+            break;
+    }
+    cg.need = std::max(cg.need, cg.nparams+cg.depth);
+}
+
+// true if 1/v is exact, so x/v and x*(1/v) round to the same value
+template<typename Num>
+bool exact_reciprocal(Num v)
+{
+    int exp;
+    Num m = frexp(v, &exp);
+    return (m==0.5 || m==-0.5) && std::isfinite(1/v);
+}
+
+// kernel selection over finished code. Multiplies feeding an add or subtract become one fma, which
+// rounds once where the statement rounds twice. x^2 becomes x*x, correctly rounded where pow() need not
+// be. The rest give the same values as the code they replace: x*x of a parameter becomes a square, 1/x a
+// reciprocal and division by a power of two a multiplication by its exact reciprocal. Returns the frame slots the new code needs, a fused
+// a*b+c keeps a and b on the stack while c runs
+template<typename Num>
+size_t calculator<Num>::select_kernels(std::vector<instr<Num>>& code, size_t nparams) const
+{
+    auto pops = [this](const instr<Num>& in) -> size_t
+    {
+        switch (in.op)
+        {
+            case op_push:
+            case op_arg:
+                return 0;
+            case op_neg:
+            case op_square:
+            case op_recip:
+                return 1;
+            case op_call:
+                return functions[in.a].params.size();
+            case op_drop:
+                return in.a+1;
+            case op_muladd:
+            case op_mulsub:
+            case op_addmul:
+            case op_submul:
+                return 3;
+            default:
+                return 2;
+        }
+    };
+    // first instruction of the operand that out[end-1] finishes, every instruction leaves one value
+    auto operand_start = [&pops](const std::vector<instr<Num>>& out, size_t end)
+    {
+        size_t need = 1;
+        while (need>0)
+        {
+            end--;
+            need = need-1+pops(out[end]);
+        }
+        return end;
+    };
+    // removing an instruction under out[from..] moves that code down the stack, which breaks it when
+    // it reads temporaries by slot, the arguments of an inlined call
+    auto movable = [nparams](const std::vector<instr<Num>>& out, size_t from)
+    {
+        for (size_t i=from; i<out.size(); i++)
+        {
+            if (out[i].op==op_arg && out[i].a>=nparams)
+                return false;
+        }
+        return true;
+    };
+
+    // x87 long double has no fma instruction and fmal in software costs ten times the statement,
+    // so wider types keep their separate multiplies and adds
+    const bool fuse = std::numeric_limits<Num>::digits<=std::numeric_limits<double>::digits;
+
+    std::vector<instr<Num>> out;
+    out.reserve(code.size());
+    for (size_t pc=0; pc<code.size(); pc++)
+    {
+        instr<Num> in = code[pc];
+        size_t n = out.size();
+        if (in.op==op_pow && out[n-1].op==op_push && out[n-1].value==2)
+        {
+            if (out[n-2].op==op_arg)    // x^2 of a parameter, as x*x it may fuse below
+            {
+                out[n-1] = out[n-2];
+                in.op = op_mul;
+            }
+            else
+            {
+                out.pop_back();
+                in.op = op_square;
+            }
+        }
+        else if (in.op==op_div && out[n-1].op==op_push && exact_reciprocal(out[n-1].value))
+        {
+            out[n-1].value = 1/out[n-1].value;
+            in.op = op_mul;
+        }
+        else if (in.op==op_div)
+        {
+            size_t r = operand_start(out, n);
+            if (out[r-1].op==op_push && out[r-1].value==1 && movable(out, r))
+            {
+                out.erase(out.begin()+r-1);
+                in.op = op_recip;
+            }
+        }
+        else if (fuse && (in.op==op_add || in.op==op_sub))
+        {
+            if (out[n-1].op==op_mul)    // c+a*b
+            {
+                out.pop_back();
+                in.op = in.op==op_add ? op_addmul : op_submul;
+            }
+            else
+            {
+                size_t r = operand_start(out, n);
+                if (out[r-1].op==op_mul && movable(out, r))    // a*b+c, the product is under c's code
+                {
+                    out.erase(out.begin()+r-1);
+                    in.op = in.op==op_add ? op_muladd : op_mulsub;
+                }
+            }
+        }
+        out.push_back(in);
+    }
+
+    // squares from the products of a parameter with itself that didn't fuse
+    code.clear();
+    for (size_t pc=0; pc<out.size(); pc++)
+    {
+        size_t n = code.size();
+        if (out[pc].op==op_mul && code[n-1].op==op_arg && code[n-2].op==op_arg && code[n-1].a==code[n-2].a)
+            code[n-1] = {op_square, 0, 0};
+        else
+            code.push_back(out[pc]);
+    }
+
+    size_t depth = 0;
+    size_t need = nparams;
+    for (size_t pc=0; pc<code.size(); pc++)
+    {
+        if (code[pc].op==op_call)
+            need = std::max(need, nparams+depth-pops(code[pc])+functions[code[pc].a].need);
+        depth = depth+1-pops(code[pc]);
+        need = std::max(need, nparams+depth);
+    }
+    return need;
+}
+
+// "(args)" after the name of function f in a statement, the arguments are evaluated onto the call stack
+// and the compiled body run over them
+template<typename Num>
+Num calculator<Num>::call_function(size_t f)
+{
+    const user_function<Num>& fn = functions[f];
+    token<Num> t = ts.get();
+    if (t.kind()!='(')
+        throw std::runtime_error("'(' expected after function name");
+    size_t base = csp;
+    t = ts.get();
+    if (t.kind()!=')')
+    {
+        ts.putback(t);
+        while (true)
+        {
+            Num arg = expression();     // may make calls of its own, above csp
+            if (csp==callstack.size())
+                throw std::runtime_error("Function calls nested too deeply for the call stack");
+            callstack[csp++] = arg;
+            t = ts.get();
+            if (t.kind()==')')
+                break;
+            if (t.kind()!=',')
+                throw std::runtime_error("',' or ')' expected in function arguments");
+        }
+    }
+    if (csp-base!=fn.params.size())
+        throw std::runtime_error("Function "+fn.name+" expects "+std::to_string(fn.params.size())+" arguments");
+    if (base+fn.need>callstack.size())
+        throw std::runtime_error("Function calls nested too deeply for the call stack");
+    Num result = run(fn, callstack.data()+base, steps);
+    csp = base;
+    return result;
+}
+
+// run fn over the arguments in frame[0..params), its temporaries go above them. The stack room for
+// the whole call tree was checked by the caller against fn.need, so nothing is checked here
+template<typename Num>
+inline __attribute__((always_inline)) Num calculator<Num>::interpret(const user_function<Num>& fn, Num* frame, step_meter& m)
+{
+    tick(m);        // a call counts as one evaluator step
+    Num* sp = frame+fn.params.size();
+    const instr<Num>* code = fn.code.data();
+    for (size_t pc=0, end=fn.code.size(); pc<end; pc++)
+    {
+        const instr<Num>& in = code[pc];
+        switch (in.op)
+        {
+            case op_push:
+                *sp++ = in.value;
+                break;
+            case op_arg:
+                *sp++ = frame[in.a];
+                break;
+            case op_add:
+                sp--;
+                sp[-1] += sp[0];
+                break;
+            case op_sub:
+                sp--;
+                sp[-1] -= sp[0];
+                break;
+            case op_mul:
+                sp--;
+                sp[-1] *= sp[0];
+                break;
+            case op_div:
+                sp--;
+                if (sp[0]==0)
+                    throw std::runtime_error("divide by zero");
+                sp[-1] /= sp[0];
+                break;
+            case op_mod:
+                sp--;
+                sp[-1] = modulo(sp[-1], sp[0], m);
+                break;
+            case op_pow:
+                sp--;
+                sp[-1] = pow(sp[-1], sp[0]);
+                break;
+            case op_neg:
+                sp[-1] *= -1;
+                break;
+            case op_call:
+            {
+                const user_function<Num>& callee = functions[in.a];
+                sp -= callee.params.size();
+                *sp = run(callee, sp, m);
+                sp++;
+                break;
+            }
+            case op_drop:
+            {
+                Num top = sp[-1];
+                sp -= in.a;
+                sp[-1] = top;
+                break;
+            }
+            case op_muladd:
+                sp -= 2;
+                sp[-1] = std::fma(sp[-1], sp[0], sp[1]);
+                break;
+            case op_mulsub:
+                sp -= 2;
+                sp[-1] = std::fma(sp[-1], sp[0], -sp[1]);
+                break;
+            case op_addmul:
+                sp -= 2;
+                sp[-1] = std::fma(sp[0], sp[1], sp[-1]);
+                break;
+            case op_submul:
+                sp -= 2;
+                sp[-1] = std::fma(-sp[0], sp[1], sp[-1]);
+                break;
+            case op_square:
+                sp[-1] *= sp[-1];
+                break;
+            case op_recip:
+                if (sp[-1]==0)
+                    throw std::runtime_error("divide by zero");
+                sp[-1] = 1/sp[-1];
+                break;
+        }
+    }
+    return sp[-1];
+}
+
+template<typename Num>
+Num calculator<Num>::run_portable(const user_function<Num>& fn, Num* frame, step_meter& m)
+{
+    return interpret(fn, frame, m);
+}
+
+template<typename Num>
+CALC_FMA_TARGET Num calculator<Num>::run_fma(const user_function<Num>& fn, Num* frame, step_meter& m)
+{
+    return interpret(fn, frame, m);
+}
+
+// iterations per block of a reduction. Each block is reduced on its own and the block results are combined
+// pairwise in order, so a result doesn't depend on how many threads shared out the blocks
+const unsigned long long REDUCE_BLOCK = 4096;
+
+// combine two partial results of a reduction
+template<typename Num>
+Num reduce_op(int which, Num left, Num right)
+{
+    switch (which)
+    {
+        case REDUCE_SUM: return left+right;
+        case REDUCE_PROD: return left*right;
+        case REDUCE_MIN: return right<left ? right : left;
+        default: return right>left ? right : left;
+    }
+}
+
+// combine parts[lo, hi) as a balanced tree, which keeps the rounding error of long sums low
+template<typename Num>
+Num combine_pairwise(int which, const std::vector<Num>& parts, size_t lo, size_t hi)
+{
+    if (hi-lo==1)
+        return parts[lo];
+    size_t mid = lo+(hi-lo)/2;
+    return reduce_op(which, combine_pairwise(which, parts, lo, mid), combine_pairwise(which, parts, mid, hi));
+}
+
+// "(i, from, to, [step,] expression)" after sum, prod, min or max. The bounds and step are evaluated
+// once and the expression compiled once with i as its parameter, then run for i = from, from+step, ... up to to
+template<typename Num>
+Num calculator<Num>::reduction(int which)
+{
+    token<Num> t = ts.get();
+    if (t.kind()!='(')
+        throw std::runtime_error("'(' expected after sum, prod, min or max");
+    std::istream& in = ts.input();  // the index is a new name, so read it directly
+    std::vector<std::string> index(1, read_name(in));
+    std::string lname = lowcase(index[0]);
+    if (index[0].empty() || is_sysvar(lname) || is_command(lname) || is_option(lname))
+        throw std::runtime_error("Bad index name. Use: sum(i, $from, $to, $expression);");
+    if (ts.get().kind()!=',')
+        throw std::runtime_error("',' expected after the index name");
+    Num from = expression();
+    if (ts.get().kind()!=',')
+        throw std::runtime_error("',' expected after the start of the range");
+    Num to = expression();
+    if (ts.get().kind()!=',')
+        throw std::runtime_error("',' expected after the end of the range");
+
+    Num step = 1;
+    codegen cg = {{}, 1, 0, 1};
+    ts.params = &index;
+    try
+    {
+        compile_expression(cg);
+        t = ts.get();
+        if (t.kind()==',')      // that was the step, the expression follows
+        {
+            for (size_t i=0; i<cg.code.size(); i++)
+            {
+                if (cg.code[i].op==op_arg && cg.code[i].a==0)
+                    throw std::runtime_error("The step of a range can't depend on its index");
+            }
+            user_function<Num> stepfn = {"", index, cg.code, cg.need};
+            std::vector<Num> frame(cg.need);
+            step = run(stepfn, frame.data(), steps);
+            cg = {{}, 1, 0, 1};
+            compile_expression(cg);
+            t = ts.get();
+        }
+    }
+    catch (...)
+    {
+        ts.params = nullptr;
+        throw;
+    }
+    ts.params = nullptr;
+    if (t.kind()!=')')
+        throw std::runtime_error("')' expected");
+
+    if (step==0 || step!=step)
+        throw std::runtime_error("The step of a range can't be 0");
+    long double span = ((long double)to-from)/step;     // in a wider type, so the count is exact for any Num range that fits
+    if (!(span>=0))     // empty range
+    {
+        if (which==REDUCE_SUM)
+            return 0;
+        if (which==REDUCE_PROD)
+            return 1;
+        throw std::runtime_error("min and max need a range with at least one value");
+    }
+    if (span>=9e15)
+        throw std::runtime_error("Range has too many steps");
+    // the last value from+last*step may land a rounding error either side of to: one within a few ulps of
+    // the range's ends is still in, so a fractional step doesn't lose the end, anything further out is not
+    unsigned long long last = (unsigned long long)floor(span);
+    Num ends = std::max(std::fabs(from), std::fabs(to));
+    Num slack = 4*(std::nextafter(ends, std::numeric_limits<Num>::infinity())-ends);
+    auto past = [&](unsigned long long k)
+    {
+        Num v = from+Num(k)*step;
+        return step>0 ? v-to>slack : to-v>slack;
+    };
+    if (last>0 && past(last))
+        last--;
+    else if (!past(last+1))
+        last++;
+    cg.need = select_kernels(cg.code, 1);
+    user_function<Num> body = {"", index, cg.code, cg.need};
+    return reduce_range(which, body, from, step, last+1);
+}
+
+// reduce body over count values of i. The blocks are shared out between worker threads, this one
+// included, each counting steps on its own meter. When blocks fail, the error of the first one is thrown
+template<typename Num>
+Num calculator<Num>::reduce_range(int which, const user_function<Num>& body, Num from, Num step, unsigned long long count)
+{
+    size_t nblocks = (count+REDUCE_BLOCK-1)/REDUCE_BLOCK;
+    std::vector<Num> parts(nblocks);
+    unsigned nthreads = threads!=0 ? threads : std::thread::hardware_concurrency();
+    if (nthreads>nblocks)
+        nthreads = nblocks;
+    if (nthreads<=1)
+    {
+        std::vector<Num> frame(body.need);
+        for (size_t b=0; b<nblocks; b++)
+            parts[b] = reduce_block(which, body, from, step, b*REDUCE_BLOCK, std::min(count, (b+1)*REDUCE_BLOCK), frame.data(), steps);
+        return combine_pairwise(which, parts, 0, nblocks);
+    }
+
+    std::atomic<unsigned long long> pool(steps.ops);
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> first_failed(nblocks);
+    std::exception_ptr failure;
+    std::mutex failing;
+    step_meter start = {0, steps.next_check==~0ULL ? ~0ULL : 1, &pool, 0};     // checks on its first step if checking at all
+    std::vector<step_meter> meters(nthreads, start);
+    auto work = [&](unsigned w)
+    {
+        std::vector<Num> frame(body.need);
+        while (true)
+        {
+            size_t b = next.fetch_add(1);
+            if (b>=nblocks || b>first_failed.load())
+                break;
+            try
+            {
+                parts[b] = reduce_block(which, body, from, step, b*REDUCE_BLOCK, std::min(count, (b+1)*REDUCE_BLOCK), frame.data(), meters[w]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(failing);
+                if (b<first_failed.load())
+                {
+                    first_failed.store(b);
+                    failure = std::current_exception();
+                }
+                break;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned w=1; w<nthreads; w++)
+        workers.emplace_back(work, w);
+    work(0);
+    for (size_t w=0; w<workers.size(); w++)
+        workers[w].join();
+    steps.ops = pool.load();
+    for (unsigned w=0; w<nthreads; w++)
+        steps.ops += meters[w].ops-meters[w].pooled;
+    if (failure)
+        std::rethrow_exception(failure);
+    if (steps.ops>=steps.next_check)    // the workers' last checks didn't see each other's final steps
+        check_budget(steps);
+    return combine_pairwise(which, parts, 0, nblocks);
+}
+
+// reduce values first to last-1 of i = from+k*step in order, sums with Kahan compensation
+template<typename Num>
+Num calculator<Num>::reduce_block(int which, const user_function<Num>& body, Num from, Num step,
+                                  unsigned long long first, unsigned long long last, Num* frame, step_meter& m)
+{
+    frame[0] = from+Num(first)*step;
+    Num acc = run(body, frame, m);
+    Num comp = 0;       // low order part lost from acc so far
+    for (unsigned long long k=first+1; k<last; k++)
+    {
+        frame[0] = from+Num(k)*step;
+        Num v = run(body, frame, m);
+        switch (which)
+        {
+            case REDUCE_SUM:
+            {
+                Num y = v-comp;
+                Num sum = acc+y;
+                comp = isinf(sum) ? 0 : (sum-acc)-y;
+                acc = sum;
+                break;
+            }
+            case REDUCE_PROD:
+                acc *= v;
+                break;
+            case REDUCE_MIN:
+                if (v<acc)
+                    acc = v;
+                break;
+            default:
+                if (v>acc)
+                    acc = v;
+                break;
+        }
+    }
+    return acc;
+}
+
+// definitions of helper functions
+
+// small helper function return all lowercase equivalent of str
+const std::string lowcase(const std::string str){
+    std::string lresult;                // result string to build
+    char ch;
+    for (size_t i=0; i<str.size();i++)
+    {
+        ch=str[i];
+        if (isalpha(ch))
+            ch = tolower(ch);
+        lresult.push_back(ch);
+    }
+    const std::string out = lresult;
+    return out;
+}
+
+// small helper function to assist peek checking, 
+// true if ch is not an operator, false if it is
+bool is_op(const char ch){
+    for (int i=0; i<NUM_OP; i++)
+    {
+        if (ch==operators[i])
+            return true;
+    }
+    return false;    
+}
+
+// small helper function to determine if a variable is a system constant
+// true if varName is a system constant
+bool is_sysvar(const std::string varName){
+    for (int i=0; i<NUM_SYSVAR; i++)
+    {
+        if (varName==reservedVarNames[i])       // cycle through sysvar portion of reserved
+            return true;
+    }
+    return false;
+}
+
+// small helper function to return value of system constant
+// expects you've checked that is_sysvar, will throw error if not is_sysvar
+template<typename Num>
+const Num get_sysvar(const std::string varName){
+    for (int i=0; i<NUM_SYSVAR; i++)
+    {
+        if (varName==reservedVarNames[i])       // cycle through sysvar portion of reserved
+            return syscons<Num>[i];
+    }
+    // only get here if it's not a system var
+    throw std::runtime_error(std::string("Attempted to get non-existant system constant ")+varName);
+}
+
+// small helper function to determine if a variable is a protected command
+// true if varName is a protected command, false otherwise
+bool is_command(const std::string varName){
+    int offset = NUM_SYSVAR;
+    for (int i=0; i<NUM_COMMAND; i++)
+    {
+        if (varName==reservedVarNames[offset+i])  // cycle through command portion of reserved
+            return true;
+    }
+    return false;
+}
+
+// small helper function to determine if a variable is a protected option/target
+// true if varName is a valid option/target, false otherwise
+bool is_option(const std::string varName){
+    int offset = NUM_SYSVAR+NUM_COMMAND;
+    for (int i=0; i<NUM_OPTIONS; i++)
+    {
+        if (varName==reservedVarNames[offset+i])  // cycle through option portion of reserved
+            return true;
+    }
+    return false;
+}
+
+// small helper function to return proper flag value
+double get_option(const std::string varName){
+    int offset = NUM_SYSVAR+NUM_COMMAND;
+    for (int i=0; i<NUM_OPTIONS; i++)
+    {
+        if (varName==reservedVarNames[offset+i])  // cycle through option portion of reserved
+        {
+            const double flag = pow(2,i);
+            return flag;
+        }
+    }
+    // fail condition
+    return 0;
+}
+
+// small helper to check if variable is an existing user variable
+// returns true if it is, false if it isn't
+template<typename Num>
+bool is_usrvar(const uservar_table<Num>& vars, const std::string varName){
+    return vars.find(varName)>=0;
+}
+
+// small helper to get existing user variable value
+// error if not in user variables
+template<typename Num>
+const Num get_usrvar(const uservar_table<Num>& vars, const std::string varName){
+    long select = vars.find(varName);
+    if (select<0)
+        throw std::runtime_error(std::string("Tried to access non-existant user var ")+varName);
+    return vars.value(select);
+}
+
+// small helper to find a user function by name, the newest definition wins
+// returns its index, -1 if there is none
+template<typename Num>
+long find_function(const std::vector<user_function<Num>>& funcs, const std::string name){
+    for (long i=long(funcs.size())-1; i>=0; i--)
+    {
+        if (funcs[i].name==name)
+            return i;
+    }
+    return -1;
+}
+
+// small helper function to tell if character is a break character ';' '\n' EOF '\0' ' '
+bool is_break(const char ch){
+    return (ch==';' || ch=='\n' || ch==EOF );
+}
+
+// read a name: skip whitespace, then take letters up to the first character that isn't one, which is left
+// in the input. Empty if the next character isn't a letter
+std::string read_name(std::istream& in){
+    std::string name;
+    char ch = 0;
+    in >> ch;
+    while (isalpha(ch))
+    {
+        name.push_back(ch);
+        if (!in.get(ch))
+            ch = 0;     // end of input also ends the name
+    }
+    in.putback(ch);
+    return name;
+}
+
+
+
+// read and run one statement: an expression, an assignment or a command
+// errors are caught and returned in the result with the input skipped past the next ';'
+template<typename Num>
+calc_result<Num> calculator<Num>::statement()
+{
+    calc_result<Num> res = {CALC_OK, empt, 0, "", ""};
+    trace_event ev = {stmt, -1, 0, 0, 0, false};
+    csp = 0;        // frames left by a failed call are abandoned
+    bool tracing = tracer!=nullptr && tracer->sampled(stmt);
+    std::chrono::steady_clock::time_point start;
+    stmt++;
+    ts.skip_prints();   // waiting for input and empty statements happen before the span starts
+    if (tracing)
+    {
+        ev.offset = ts.input().tellg();
+        if (ev.offset>=0)
+            ev.offset += inputBase;
+        ts.timed = true;
+        ts.lexed = std::chrono::nanoseconds(0);
+        start = std::chrono::steady_clock::now();
+    }
+    try        
+    {
+        token<Num> t = ts.get();
+        // first discard all “prints”
+        while (t.kind() == print)
+            t = ts.get();
+        start_budget();     // only now, time spent waiting for input doesn't count and a Ctrl-C at the prompt isn't kept
+
+        res.kind = t.kind();
+        switch (t.kind())
+        {
+            case quit:      // ‘q’ or “quit”, or the end of the input
+            {
+                res.value = t.value();
+                break;
+            }
+            case help:      // print help message
+            {
+                if (out!=nullptr)
+                    *out << std::endl << helptext << std::endl;
+                break;
+            }
+            case disp:   // command to display something
+            {
+                int flag = 0;   //get int to switch based off flags, adjust for float precision
+                flag += t.value();
+                if (out!=nullptr)
+                    display(flag);
+                break;
+            }
+            case del:
+            {
+                if (t.value()==DELETE_ALL)
+                {
+                    userVars.clear();
+                    if (journal!=nullptr)
+                        journal->append(JOURNAL_CLEAR, "", nullptr);
+                    if (out!=nullptr)
+                        *out << "Cleared all user variables." << std::endl;
+                    break;
+                }
+                long select = userVars.find(t.getname());
+                if (select<0)
+                    throw std::runtime_error("Invalid target name for deletion");
+                res.name = t.getname();
+                userVars.erase(select);
+                if (journal!=nullptr)
+                    journal->append(JOURNAL_DEL, res.name, nullptr);
+                if (out!=nullptr)
+                    *out << "Succesfully erased variable " << res.name << std::endl;
+                break;
+            }
+            case setvar:
+            {   
+                int assign = t.value();
+                std::string vname = t.getname();
+                res.name = vname;
+                if (assign==0)  // create new var and set to zero
+                {
+                    if (is_usrvar(userVars, vname)) //already exists
+                    {
+                        throw std::runtime_error(std::string("Tried to create an existing variable")+vname);
+                        break;
+                    }
+                    else     // create and zero var
+                    {
+                        userVars.add(vname,0);
+                        if (journal!=nullptr)
+                            journal->append(JOURNAL_SET, vname, &res.value);
+                        if (out!=nullptr)
+                            *out << "Created new user variable " << vname << " with value 0." << std::endl;
+                        break;
+                    }
+                }
+                if (assign==1)  // assign with following expression
+                {
+                    long select = userVars.find(vname);
+                    if (select<0)   // varname doesn't yet exist, get value then create it
+                    {   
+                        Num dval = expression();
+                        userVars.add(vname,dval);
+                        res.value = dval;
+                        if (journal!=nullptr)
+                            journal->append(JOURNAL_SET, vname, &dval);
+                        if (out!=nullptr)
+                            *out << "Created new user variable " << vname << " with value " << dval << std::endl;
+                        break;
+                    }
+                    else    // existing var, replace value
+                    {
+                        Num oldval = userVars.value(select);
+                        Num newval = expression();
+                        userVars.setvalue(select,newval);
+                        res.value = newval;
+                        if (journal!=nullptr)
+                            journal->append(JOURNAL_SET, vname, &newval);
+                        if (out!=nullptr)
+                            *out << "User variable " << vname << " updated, was " << oldval << ", now " << vname << " = " << newval << std::endl;
+                        break;
+                    }
+                }
+                // only here for invalid assign set, throw error
+                throw std::runtime_error("Invalid setvar assign value, must be 0 or 1");
+            }
+            case pub:       // publish name = (expression) to the shared namespace
+            {
+                if (shared==nullptr)
+                    throw std::runtime_error("No shared namespace to publish to");
+                res.name = t.getname();
+                res.value = expression();
+                shared->publish(res.name, res.value);
+                if (out!=nullptr)
+                    *out << "Published " << res.name << " = " << res.value << std::endl;
+                break;
+            }
+            case fdef:      // def name(params) = (expression);
+            {
+                res.name = t.getname();
+                bool redefined = find_function(functions, res.name)>=0;
+                define(res.name);
+                if (out!=nullptr)
+                    *out << (redefined ? "Redefined" : "Defined") << " function " << res.name << " with "
+                         << functions.back().params.size() << " parameters, compiled to " << functions.back().code.size() << " instructions" << std::endl;
+                break;
+            }
+            // all these are acceptable starts to expression
+            case '(':   
+            case '-':
+            case number:
+            case fcall:
+            case reduce:
+            {
+                ts.putback(t);
+                res.kind = number;
+                res.value = expression();
+                break;
+            }
+            default:
+                throw std::runtime_error("No matching kind for token");
+        }
+    }
+    catch (budget_error const& e)
+    {
+        res.code = e.code();
+        res.error = e.what();
+        clean_up_mess();                       // the rest of the statement is skipped as for any error
+        ev.failed = true;
+    }
+    catch (std::runtime_error const& e)
+    {
+        res.code = CALC_ERR_EVAL;
+        res.error = e.what();
+        clean_up_mess();                       // <<< The tricky part!
+        ev.failed = true;
+    }
+    bool ended = res.kind==quit && res.value!=0 && res.code==CALC_OK;
+    if (ended)
+        stmt--;         // the end of the input isn't a statement, it isn't counted or traced
+    if (tracing && !ended)
+    {
+        auto stop = std::chrono::steady_clock::now();
+        ev.start = tracer->since_origin(start);
+        ev.total = std::chrono::duration_cast<std::chrono::nanoseconds>(stop-start).count();
+        ev.lex = ts.lexed.count();
+        tracer->record(ev);
+    }
+    ts.timed = false;
+    return res;
+}
+
+// how many evaluator steps pass between checks of the clock and the cancellation flag
+const unsigned long long CHECK_EVERY = 1024;
+
+template<typename Num>
+void calculator<Num>::start_budget()
+{
+    steps.ops = 0;
+    if (cancel!=nullptr)
+        cancel->store(false);   // a cancel only applies to the statement running when it is set
+    if (budget.max_ops==0 && budget.time.count()==0 && cancel==nullptr)
+    {
+        steps.next_check = ~0ULL;   // nothing to check, tick() is just an increment
+        return;
+    }
+    steps.next_check = CHECK_EVERY;
+    if (budget.max_ops!=0 && budget.max_ops<steps.next_check)
+        steps.next_check = budget.max_ops+1;
+    if (budget.time.count()!=0)
+        deadline = std::chrono::steady_clock::now()+budget.time;
+}
+
+template<typename Num>
+void calculator<Num>::check_budget(step_meter& m)
+{
+    unsigned long long total = m.ops;
+    if (m.pool!=nullptr)    // a reduction worker, the budget is for all of them together
+    {
+        total = m.pool->fetch_add(m.ops-m.pooled)+(m.ops-m.pooled);
+        m.pooled = m.ops;
+    }
+    if (budget.max_ops!=0 && total>budget.max_ops)
+        throw budget_error(CALC_ERR_BUDGET, "Statement exceeded its operation budget");
+    if (cancel!=nullptr && cancel->load(std::memory_order_relaxed))
+        throw budget_error(CALC_ERR_CANCELLED, "Statement cancelled");
+    if (budget.time.count()!=0 && std::chrono::steady_clock::now()>deadline)
+        throw budget_error(CALC_ERR_BUDGET, "Statement exceeded its time budget");
+    m.next_check = m.ops+CHECK_EVERY;
+    if (budget.max_ops!=0 && budget.max_ops-total<CHECK_EVERY)
+        m.next_check = m.ops+(budget.max_ops-total)+1;
+}
+
+// listings for the display command, flag is one of the DISP_ flags
+template<typename Num>
+void calculator<Num>::display(int flag)
+{
+    switch (flag)
+    {
+        case DISP_SYS_FLAG:
+        {
+            *out << "Displaying system constants:" << std::endl;
+            for (int i=0; i<NUM_SYSVAR; i++)
+            {
+                *out << "Constant name: " << reservedVarNames[i] << " = " << syscons<Num>[i] <<std::endl;
+            }
+            break;
+        }
+        case DISP_USER_FLAG:
+        {
+            int uvsize = userVars.size();
+            if (uvsize==0)      // no user variables
+            {
+                *out << "No user variables to display." << std::endl;
+                break;
+            }
+            *out << "Displaying all " << uvsize << " user variables:" << std::endl;
+            for (size_t i=0; i<userVars.positions(); i++)
+            {
+                if (!userVars.erased(i))
+                    *out << "Variable name: " << userVars.name(i) << " = " << userVars.value(i) << std::endl;
+            }
+            break;
+        }
+        case DISP_ALL_FLAG:
+        {
+            *out << "Displaying all system constants, then all user variables..." << std::endl;
+            display(DISP_SYS_FLAG);
+            display(DISP_USER_FLAG);
+            if (shared!=nullptr)
+                display(DISP_SHARED_FLAG);
+            if (!functions.empty())
+                display(DISP_FUNC_FLAG);
+            break;
+        }
+        case DISP_FUNC_FLAG:
+        {
+            if (functions.empty())
+            {
+                *out << "No user functions to display." << std::endl;
+                break;
+            }
+            *out << "Displaying all " << functions.size() << " user functions:" << std::endl;
+            for (size_t i=0; i<functions.size(); i++)
+            {
+                const user_function<Num>& fn = functions[i];
+                *out << "Function: " << fn.name << "(";
+                for (size_t k=0; k<fn.params.size(); k++)
+                    *out << (k>0 ? "," : "") << fn.params[k];
+                *out << "), " << fn.code.size() << " instructions";
+                if (fn.code.size()<=INLINE_MAX_OPS)
+                    *out << ", inlined into later definitions";
+                if (find_function(functions, fn.name)!=long(i))
+                    *out << ", shadowed by a later definition";
+                *out << std::endl;
+            }
+            break;
+        }
+        case DISP_MEM_FLAG:
+        {
+            size_t bytes = userVars.memory();
+            *out << "User variables: " << userVars.size() << ", using " << bytes << " bytes";
+            if (userVars.size()>0)
+                *out << " (" << double(bytes)/userVars.size() << " bytes per variable)";
+            *out << std::endl;
+            break;
+        }
+        case DISP_SHARED_FLAG:
+        {
+            if (shared==nullptr)
+            {
+                *out << "No shared namespace attached." << std::endl;
+                break;
+            }
+            std::vector<std::pair<std::string,Num>> pubs = shared->snapshot(slot);
+            if (pubs.empty())
+            {
+                *out << "No published constants to display." << std::endl;
+                break;
+            }
+            *out << "Displaying all " << pubs.size() << " published constants:" << std::endl;
+            for (size_t i=0; i<pubs.size(); i++)
+            {
+                *out << "Published name: " << pubs[i].first << " = " << pubs[i].second << std::endl;
+            }
+            break;
+        }
+        case DISP_OP_FLAG:
+        {
+            *out << "Displaying valid operators:" << std::endl;
+            for (int i=0; i<NUM_OP; i++)
+                *out << operators[i] << " : " << opdescrip[i] << std::endl;
+            break;
+        }
+        default:
+            throw std::runtime_error("Invalid display code for display command.");
+    }
+}
+
+// run every statement in src in order, one result per statement is appended to results
+// stops early on 'q', which gets a result too. Returns CALC_OK, or the code of the first statement that failed.
+// base is where src starts in a longer input cut into pieces, traced offsets count from there
+template<typename Num>
+int calculator<Num>::evaluate(const std::string& src, std::vector<calc_result<Num>>& results, long long base)
+{
+    std::istream& previous = ts.input();
+    std::istringstream in(src);
+    ts.set_input(in);
+    inputBase = base;
+    int code = CALC_OK;
+    while (true)
+    {
+        calc_result<Num> res = statement();
+        if (res.kind==quit && res.code==CALC_OK)
+        {
+            if (res.value==0)       // 'q' rather than the end of src
+                results.push_back(res);
+            break;
+        }
+        if (code==CALC_OK)
+            code = res.code;
+        results.push_back(res);
+    }
+    ts.set_input(previous);
+    inputBase = 0;
+    return code;
+}
+
+// value of user variable name, false if there isn't one
+template<typename Num>
+bool calculator<Num>::get_var(const std::string& name, Num& value) const
+{
+    long select = userVars.find(name);
+    if (select<0)
+        return false;
+    value = userVars.value(select);
+    return true;
+}
+
+// set user variable name to value, creating it if needed
+// names follow the same rules as in statements: alpha characters only and not reserved
+template<typename Num>
+int calculator<Num>::set_var(const std::string& name, Num value)
+{
+    if (name.empty() || !std::all_of(name.begin(), name.end(), [](char ch){return isalpha(ch)!=0;}))
+        return CALC_ERR_NAME;
+    std::string lname = lowcase(name);
+    if (is_sysvar(lname) || is_command(lname) || is_option(lname) || find_function(functions, name)>=0)
+        return CALC_ERR_NAME;
+    long select = userVars.find(name);
+    if (select<0)
+        userVars.add(name,value);
+    else
+        userVars.setvalue(select,value);
+    if (journal!=nullptr)
+        journal->append(JOURNAL_SET, name, &value);
+    return CALC_OK;
+}
+
+// read all of the file at path into data, false if it can't be opened
+static bool read_file(const std::string& path, std::string& data)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    in.seekg(0, std::ios::end);
+    data.resize(in.tellg());
+    in.seekg(0);
+    in.read(&data[0], data.size());
+    data.resize(in.gcount());
+    return true;
+}
+
+// apply the records of the journal at path straight to the user variables, no statements are lexed or run
+// and nothing is journaled again. Returns the number of records applied, throws std::runtime_error if the
+// file can't be read or isn't a journal of this engine's type. A torn record at the end is ignored
+template<typename Num>
+unsigned long long calculator<Num>::replay(const std::string& path)
+{
+    std::string data;
+    if (!read_file(path, data))
+        throw std::runtime_error("Could not open journal "+path);
+    size_t pos = session_journal::check_header(data, sizeof(Num));
+    char kind;
+    std::string name;
+    const char* value;
+    unsigned long long count = 0;
+    while (session_journal::read_record(data, pos, sizeof(Num), kind, name, value))
+    {
+        long select = kind==JOURNAL_CLEAR ? -1 : userVars.find(name);
+        switch (kind)
+        {
+            case JOURNAL_SET:
+            {
+                Num v;
+                memcpy(&v, value, sizeof(Num));
+                if (select<0)
+                    userVars.add(name,v);
+                else
+                    userVars.setvalue(select,v);
+                break;
+            }
+            case JOURNAL_DEL:
+                if (select>=0)
+                    userVars.erase(select);
+                break;
+            default:
+                userVars.clear();
+                break;
+        }
+        count++;
+    }
+    return count;
+}
+
+// write the recorded spans, oldest first, as Chrome Trace Event JSON. Each statement is a span with
+// a "lex" child and a "parse+eval" child after it, lexing is interleaved with parsing so the lex
+// child is the summed time of the statement's token reads rather than one contiguous stretch
+void session_tracer::dump(std::ostream& out) const
+{
+    std::ios_base::fmtflags oldflags = out.flags(std::ios_base::fixed);   // times in us to ns resolution
+    std::streamsize oldprec = out.precision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    size_t first = (next+ring.size()-count)%ring.size();
+    char const* sep = "\n";
+    for (size_t i=0; i<count; i++)
+    {
+        const trace_event& ev = ring[(first+i)%ring.size()];
+        double ts = ev.start/1000.0;       // trace format wants microseconds
+        double lex = ev.lex/1000.0;
+        double total = ev.total/1000.0;
+        out << sep << "{\"name\":\"statement\",\"cat\":\"calc\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << ts << ",\"dur\":" << total
+            << ",\"args\":{\"index\":" << ev.index << ",\"offset\":" << ev.offset << ",\"error\":" << (ev.failed ? "true" : "false") << "}}";
+        sep = ",\n";
+        out << sep << "{\"name\":\"lex\",\"cat\":\"calc\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << ts << ",\"dur\":" << lex << "}";
+        out << sep << "{\"name\":\"parse+eval\",\"cat\":\"calc\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << ts+lex << ",\"dur\":" << total-lex << "}";
+    }
+    out << "\n]}\n";
+    out.flags(oldflags);
+    out.precision(oldprec);
+}
+
+// gathered records are written before the commit interval is up once there are this many bytes
+const size_t JOURNAL_EAGER_BYTES = 1<<20;
+const char JOURNAL_MAGIC[] = "CCJ1";
+const size_t JOURNAL_HEADER = 5;    // magic and value size
+
+session_journal::session_journal(const std::string& path, size_t bytesPerValue, std::chrono::milliseconds commitEvery)
+  : fd(-1)
+  , valueSize(bytesPerValue)
+  , interval(commitEvery)
+  , appended(0)
+  , durable(0)
+  , flushing(false)
+  , stopping(false)
+{
+    // find the end of the last whole record, a crash may have left part of one after it
+    std::string data;
+    size_t end = 0;
+    if (read_file(path, data) && !(data.size()<JOURNAL_HEADER && data.compare(0, data.size(), JOURNAL_MAGIC, data.size())==0))
+    {
+        end = check_header(data, valueSize);
+        char kind;
+        std::string name;
+        const char* value;
+        while (read_record(data, end, valueSize, kind, name, value))
+            ;
+    }
+    fd = open(path.c_str(), O_WRONLY|O_CREAT, 0644);
+    if (fd<0)
+        throw std::runtime_error("Could not open journal "+path+": "+strerror(errno));
+    if (ftruncate(fd, end)!=0 || lseek(fd, end, SEEK_SET)<0)
+    {
+        std::string why = strerror(errno);
+        close(fd);
+        throw std::runtime_error("Could not open journal "+path+": "+why);
+    }
+    if (end==0)     // new journal
+    {
+        pending.assign(JOURNAL_MAGIC, 4);
+        pending.push_back(char(valueSize));
+        appended = pending.size();
+    }
+    writer = std::thread(&session_journal::write_loop, this);
+}
+
+session_journal::~session_journal()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    close(fd);
+}
+
+void session_journal::append(char kind, const std::string& name, const void* value)
+{
+    uint32_t len = name.size();
+    std::lock_guard<std::mutex> lk(lock);
+    if (!error.empty())
+        throw std::runtime_error(error);
+    size_t before = pending.size();
+    pending.push_back(kind);
+    pending.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    pending.append(name);
+    if (kind==JOURNAL_SET)
+        pending.append(static_cast<const char*>(value), valueSize);
+    appended += pending.size()-before;
+    if (pending.size()>=JOURNAL_EAGER_BYTES)
+        wake.notify_one();
+}
+
+void session_journal::flush()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    unsigned long long target = appended;
+    flushing = true;
+    wake.notify_one();
+    written.wait(lk, [&]{ return durable>=target || !error.empty(); });
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+// the background writer: once per interval, or sooner when asked, take everything pending and make it durable
+void session_journal::write_loop()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    while (true)
+    {
+        wake.wait_for(lk, interval, [this]{ return stopping || flushing || pending.size()>=JOURNAL_EAGER_BYTES; });
+        flushing = false;
+        if (pending.empty())
+        {
+            if (stopping)
+                break;
+            continue;
+        }
+        std::string batch;
+        batch.swap(pending);
+        unsigned long long upto = appended;
+        lk.unlock();        // appends carry on into the next batch meanwhile
+        std::string failed;
+        size_t done = 0;
+        while (done<batch.size())
+        {
+            ssize_t n = write(fd, batch.data()+done, batch.size()-done);
+            if (n<0 && errno==EINTR)
+                continue;
+            if (n<0)
+            {
+                failed = std::string("Journal write failed: ")+strerror(errno);
+                break;
+            }
+            done += n;
+        }
+        if (failed.empty() && fdatasync(fd)!=0)
+            failed = std::string("Journal fsync failed: ")+strerror(errno);
+        lk.lock();
+        if (!failed.empty() && error.empty())
+            error = failed;
+        durable = upto;
+        written.notify_all();
+    }
+}
+
+bool session_journal::read_record(const std::string& data, size_t& pos, size_t bytesPerValue, char& kind, std::string& name, const char*& value)
+{
+    uint32_t len;
+    if (data.size()-pos<1+sizeof(len))
+        return false;
+    kind = data[pos];
+    if (kind!=JOURNAL_SET && kind!=JOURNAL_DEL && kind!=JOURNAL_CLEAR)
+        return false;
+    memcpy(&len, data.data()+pos+1, sizeof(len));
+    size_t size = 1+sizeof(len)+len+(kind==JOURNAL_SET ? bytesPerValue : 0);
+    if (data.size()-pos<size)
+        return false;
+    name.assign(data, pos+1+sizeof(len), len);
+    value = kind==JOURNAL_SET ? data.data()+pos+1+sizeof(len)+len : nullptr;
+    pos += size;
+    return true;
+}
+
+size_t session_journal::check_header(const std::string& data, size_t bytesPerValue)
+{
+    if (data.size()<JOURNAL_HEADER || data.compare(0, 4, JOURNAL_MAGIC)!=0)
+        throw std::runtime_error("Not a calculator journal");
+    if ((unsigned char)data[4]!=bytesPerValue)
+        throw std::runtime_error("Journal was written by an engine with another numeric type");
+    return JOURNAL_HEADER;
+}
+
+// the engines compiled into the library
+template class calculator<float>;
+template class calculator<double>;
+template class calculator<long double>;
+
+
+// C interface, see consolecalc.h
+struct calc_shared
+{
+    shared_namespace<calc_num> ns;
+};
+
+struct calc_context
+{
+    calculator<calc_num> calc;
+    std::string error;      // last error message, returned by calc_last_error()
+    std::vector<calc_result<calc_num>> results;     // reused between calls
+    std::atomic<bool> cancel;   // set by calc_cancel()
+    std::unique_ptr<session_journal> journal;   // set by calc_set_journal()
+
+    calc_context()
+      : calc(std::cin, nullptr)     // nothing is read from std::cin, evaluate() swaps in each source string
+      , cancel(false)
+    {
+        calc.set_cancel(&cancel);
+    }
+};
+
+calc_context* calc_create(void)
+{
+    try
+    {
+        return new calc_context();
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void calc_destroy(calc_context* ctx)
+{
+    delete ctx;
+}
+
+calc_shared* calc_shared_create(void)
+{
+    try
+    {
+        return new calc_shared();
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void calc_shared_destroy(calc_shared* sh)
+{
+    delete sh;
+}
+
+int calc_set_shared(calc_context* ctx, calc_shared* sh)
+{
+    if (ctx==nullptr)
+        return CALC_ERR_ARG;
+    try
+    {
+        ctx->calc.set_shared(sh!=nullptr ? &sh->ns : nullptr);
+        return CALC_OK;
+    }
+    catch (std::exception const& e)
+    {
+        ctx->error = e.what();
+        return CALC_ERR_INTERNAL;
+    }
+}
+
+int calc_set_budget(calc_context* ctx, unsigned long long max_ops, double timeout_ms)
+{
+    if (ctx==nullptr || timeout_ms<0)
+        return CALC_ERR_ARG;
+    calc_budget b = {max_ops, std::chrono::nanoseconds((long long)(timeout_ms*1e6))};
+    ctx->calc.set_budget(b);
+    return CALC_OK;
+}
+
+int calc_set_journal(calc_context* ctx, const char* path)
+{
+    if (ctx==nullptr)
+        return CALC_ERR_ARG;
+    try
+    {
+        ctx->calc.set_journal(nullptr);
+        ctx->journal.reset();       // the old journal is written out first
+        if (path!=nullptr)
+        {
+            ctx->journal.reset(new session_journal(path, sizeof(calc_num)));
+            ctx->calc.set_journal(ctx->journal.get());
+        }
+        return CALC_OK;
+    }
+    catch (std::exception const& e)
+    {
+        ctx->error = e.what();
+        return CALC_ERR_EVAL;
+    }
+}
+
+int calc_replay(calc_context* ctx, const char* path)
+{
+    if (ctx==nullptr || path==nullptr)
+        return CALC_ERR_ARG;
+    try
+    {
+        ctx->calc.replay(path);
+        return CALC_OK;
+    }
+    catch (std::exception const& e)
+    {
+        ctx->error = e.what();
+        return CALC_ERR_EVAL;
+    }
+}
+
+int calc_set_threads(calc_context* ctx, unsigned threads)
+{
+    if (ctx==nullptr)
+        return CALC_ERR_ARG;
+    ctx->calc.set_threads(threads);
+    return CALC_OK;
+}
+
+void calc_cancel(calc_context* ctx)
+{
+    if (ctx!=nullptr)
+        ctx->cancel.store(true);
+}
+
+int calc_eval(calc_context* ctx, const char* src, double* result)
+{
+    if (ctx==nullptr || src==nullptr)
+        return CALC_ERR_ARG;
+    try
+    {
+        ctx->results.clear();
+        int code = ctx->calc.evaluate(src, ctx->results);
+        ctx->error.clear();
+        for (size_t i=0; i<ctx->results.size(); i++)
+        {
+            const calc_result<calc_num>& res = ctx->results[i];
+            if (res.code!=CALC_OK)
+            {
+                if (ctx->error.empty())
+                    ctx->error = res.error;     // report the first failure
+            }
+            else if (result!=nullptr && (res.kind==number || res.kind==setvar || res.kind==pub))
+                *result = res.value;
+        }
+        return code;
+    }
+    catch (std::exception const& e)
+    {
+        ctx->error = e.what();
+        return CALC_ERR_INTERNAL;
+    }
+    catch (...)
+    {
+        ctx->error = "unknown exception";
+        return CALC_ERR_INTERNAL;
+    }
+}
+
+size_t calc_eval_batch(calc_context* ctx, const char* const* srcs, size_t count, double* results, int* codes)
+{
+    size_t failed = 0;
+    for (size_t i=0; i<count; i++)
+    {
+        if (results!=nullptr)
+            results[i] = std::numeric_limits<double>::quiet_NaN();
+        int code = calc_eval(ctx, srcs!=nullptr ? srcs[i] : nullptr, results!=nullptr ? &results[i] : nullptr);
+        if (codes!=nullptr)
+            codes[i] = code;
+        if (code!=CALC_OK)
+        {
+            failed++;
+            if (results!=nullptr)
+                results[i] = std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+    return failed;
+}
+
+int calc_get_var(calc_context* ctx, const char* name, double* value)
+{
+    if (ctx==nullptr || name==nullptr || value==nullptr)
+        return CALC_ERR_ARG;
+    calc_num v;
+    if (!ctx->calc.get_var(name, v))
+        return CALC_ERR_NOVAR;
+    *value = v;
+    return CALC_OK;
+}
+
+int calc_set_var(calc_context* ctx, const char* name, double value)
+{
+    if (ctx==nullptr || name==nullptr)
+        return CALC_ERR_ARG;
+    try
+    {
+        return ctx->calc.set_var(name, value);
+    }
+    catch (...)
+    {
+        return CALC_ERR_INTERNAL;
+    }
+}
+
+const char* calc_last_error(const calc_context* ctx)
+{
+    if (ctx==nullptr)
+        return "";
+    return ctx->error.c_str();
+}
@@ -0,0 +1,923 @@
+// Calculator engine: lexer, parser and evaluator, templated on the numeric type.
+// Built into libconsolecalc together with calc_engine.cpp, see consolecalc.h for the C interface
+#ifndef CALC_ENGINE_H
+#define CALC_ENGINE_H
+
+#include <iostream>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <thread>
+#include <condition_variable>
+
+// numeric type the calculator binary is built for, override at compile time e.g. -DCALC_NUM_T=float or -DCALC_NUM_T="long double"
+// the library always carries the float, double and long double engines
+#ifndef CALC_NUM_T
+#define CALC_NUM_T double
+#endif
+typedef CALC_NUM_T calc_num;
+
+// the bytecode interpreter is built twice on x86-64, for CPUs with FMA and for the rest, and each calculator picks
+// one when it is made. Both give the same results: the FMA build does a fused kernel in one instruction, the other
+// calls std::fma, which without the instruction is done in software and is several times slower. Only the
+// interpreter is built for FMA, with it enabled the compiler also contracts a*b+c in plain code, which would tie
+// results to the CPU. -DCALC_NO_FMA_BUILD builds just the portable one
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(CALC_NO_FMA_BUILD)
+#define CALC_FMA_BUILD 1
+#define CALC_FMA_TARGET __attribute__((target("fma")))
+#else
+#define CALC_FMA_BUILD 0
+#define CALC_FMA_TARGET
+#endif
+
+inline bool cpu_has_fma()
+{
+#if CALC_FMA_BUILD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+#define NUM_OP 11            // number of accepted operators
+#define NUM_SYSVAR 4        // to allow easier modifiability if new constants are added
+#define NUM_COMMAND 11      // numbers of protected command names
+#define NUM_OPTIONS 7       // number of option/target keywords
+
+// doubles for vals
+const double DISP_SYS =   1.0; // 2^0               // command pass values
+const double DISP_USER =  2.0; // 2^1              // doubles so will be accepted as values
+const double DISP_ALL =   4.0; // 2^2
+const double DISP_OP =    8.0; // 2^3
+const double DISP_SHARED = 16.0; // 2^4
+const double DISP_MEM =   32.0; // 2^5
+const double DISP_FUNC =  64.0; // 2^6
+
+const double DELETE_ALL= -1.0;
+
+// ints for flag switch
+const int DISP_SYS_FLAG =   1;
+const int DISP_USER_FLAG =  2;
+const int DISP_ALL_FLAG =   4;
+const int DISP_OP_FLAG =    8;
+const int DISP_SHARED_FLAG = 16;
+const int DISP_MEM_FLAG =   32;
+const int DISP_FUNC_FLAG =  64;
+
+const int DELETE_ALL_FLAG= -1;
+
+
+
+// Token stuff
+// Token “kind” values:
+char const number = '9';    // a floating-point number is now 9, because we've gone beyond only positives
+char const quit = 'q';      // an exit command
+char const print = ';';     // a print command
+char const help = 'h';      // display help text
+char const disp = 'd';      // a command to display variables, either system, user, or all
+char const del = 'k';       // a command to delete user variables
+char const setvar = 'v';    // a token assigning a variable, either adding to the set or overwriting
+char const pub = 'p';       // a token publishing a value to the shared namespace
+char const fdef = 'f';      // a command defining a user function, the parameters and body follow in the input
+char const fcall = 'c';     // a call of a user function, value is its index
+char const fparam = 'x';    // a parameter of the function being defined, value is its slot
+char const reduce = 'r';    // sum, prod, min or max over a range, value tells which
+char const empt = '\0';       // a default value for kind_ in token, on resolve will throw an error
+
+// table of user defined variables stored as separate arrays: every name packed into one character
+// arena, an offset per variable into it, and the values contiguous so scans stay in cache.
+// An open addressing hash index over the names makes lookups O(1). Variables keep creation order.
+// Erasing only marks the variable's position as erased and takes it out of the index, the arrays are
+// compacted once more than half their positions are erased so deletes stay O(1) amortized
+template<typename Num>
+class uservar_table
+{
+    std::string names;                  // all names back to back, no separators
+    std::vector<unsigned> offsets;      // name i is names[offsets[i], offsets[i+1]), always positions()+1 entries
+    std::vector<Num> values;
+    std::vector<bool> gone;             // position i has been erased
+    size_t removed;                     // erased positions not yet compacted away
+    std::vector<unsigned> index;        // hash slots holding variable number+1, 0 for empty, power of 2 size
+
+    static size_t hash(const char* s, size_t len)    // FNV-1a
+    {
+        size_t h = 14695981039346656037ULL;
+        for (size_t i=0; i<len; i++)
+        {
+            h ^= (unsigned char)s[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+    size_t home(size_t i) const     // the slot variable i hashes to
+    {
+        return hash(names.data()+offsets[i], offsets[i+1]-offsets[i]) & (index.size()-1);
+    }
+    bool name_is(size_t i, const std::string& nm) const
+    {
+        size_t len = offsets[i+1]-offsets[i];
+        return len==nm.size() && memcmp(names.data()+offsets[i], nm.data(), len)==0;
+    }
+    void insert_index(size_t i)
+    {
+        size_t mask = index.size()-1;
+        size_t slot = home(i);
+        while (index[slot]!=0)
+            slot = (slot+1) & mask;
+        index[slot] = i+1;
+    }
+    // take variable i out of the index, moving back any later entry of its probe run that
+    // can take the freed slot so lookups never need tombstones
+    void remove_index(size_t i)
+    {
+        size_t mask = index.size()-1;
+        size_t hole = home(i);
+        while (index[hole]!=i+1)
+            hole = (hole+1) & mask;
+        for (size_t slot = (hole+1) & mask; index[slot]!=0; slot = (slot+1) & mask)
+        {
+            size_t h = home(index[slot]-1);
+            if (((slot-h) & mask) >= ((slot-hole) & mask))     // h is not cyclically in (hole, slot]
+            {
+                index[hole] = index[slot];
+                hole = slot;
+            }
+        }
+        index[hole] = 0;
+    }
+    // grow by a quarter rather than doubling, spare capacity would otherwise cost up to half the table
+    template<typename V>
+    static void make_room(V& v, size_t extra)
+    {
+        if (v.size()+extra>v.capacity())
+            v.reserve(v.size()+extra+v.size()/4);
+    }
+    void rebuild_index(size_t slots)
+    {
+        index.assign(slots, 0);
+        for (size_t i=0; i<values.size(); i++)
+            if (!gone[i])
+                insert_index(i);
+    }
+    // drop the erased positions, later variables move down keeping their order
+    void compact()
+    {
+        size_t to = 0;
+        unsigned at = 0;
+        for (size_t i=0; i<values.size(); i++)
+        {
+            if (gone[i])
+                continue;
+            unsigned len = offsets[i+1]-offsets[i];
+            memmove(&names[at], names.data()+offsets[i], len);     // at<=offsets[i], so nothing unread is overwritten
+            offsets[to] = at;
+            values[to] = values[i];
+            at += len;
+            to++;
+        }
+        names.resize(at);
+        offsets.resize(to+1);
+        offsets[to] = at;
+        values.resize(to);
+        gone.assign(to, false);
+        removed = 0;
+        rebuild_index(index.size());
+    }
+
+public:
+    uservar_table()
+      : offsets(1, 0)
+      , removed(0)
+    {
+    }
+
+    size_t size() const     // variables in the table
+    {
+        return values.size()-removed;
+    }
+    // positions run from 0 to positions(), in creation order, skipping the erased ones visits every variable
+    size_t positions() const
+    {
+        return values.size();
+    }
+    bool erased(size_t i) const
+    {
+        return gone[i];
+    }
+    // position of variable nm, -1 if there isn't one
+    long find(const std::string& nm) const
+    {
+        if (index.empty())
+            return -1;
+        size_t mask = index.size()-1;
+        for (size_t slot = hash(nm.data(), nm.size()) & mask; index[slot]!=0; slot = (slot+1) & mask)
+        {
+            if (name_is(index[slot]-1, nm))
+                return index[slot]-1;
+        }
+        return -1;
+    }
+    std::string name(size_t i) const
+    {
+        return names.substr(offsets[i], offsets[i+1]-offsets[i]);
+    }
+    Num value(size_t i) const
+    {
+        return values[i];
+    }
+    void setvalue(size_t i, Num v)
+    {
+        values[i] = v;
+    }
+    // append a new variable, the caller has checked nm isn't already in the table
+    void add(const std::string& nm, Num v)
+    {
+        make_room(names, nm.size());
+        make_room(offsets, 1);
+        make_room(values, 1);
+        names.append(nm);
+        offsets.push_back(names.size());
+        values.push_back(v);
+        gone.push_back(false);
+        if (values.size()*4>index.size()*3)   // keep the index at most 3/4 full, erased positions included
+            rebuild_index(index.empty() ? 16 : index.size()*2);
+        else
+            insert_index(values.size()-1);
+    }
+    // remove the variable at position i, positions found before this are no longer valid
+    void erase(size_t i)
+    {
+        remove_index(i);
+        gone[i] = true;
+        removed++;
+        if (removed*2>values.size())
+            compact();
+    }
+    void clear()
+    {
+        names.clear();
+        offsets.assign(1, 0);
+        values.clear();
+        gone.clear();
+        removed = 0;
+        index.clear();
+    }
+    // bytes held by the table, including spare capacity and erased variables not yet compacted away
+    size_t memory() const
+    {
+        return names.capacity()+offsets.capacity()*sizeof(unsigned)+values.capacity()*sizeof(Num)
+              +gone.capacity()/8+index.capacity()*sizeof(unsigned);
+    }
+};
+
+// extended to include a name to preserve for user variable assignments
+template<typename Num>
+class token
+{
+    char kind_;       // what kind of token
+    Num value_;       // for numbers: a value
+    std::string name_;// for variable assignments
+
+public:
+    // constructors
+    token()
+      : kind_(empt)      // 'err' = '\0', should only occur in improperly initialized tokens
+      , value_(0)
+      , name_("")
+    {
+    }
+    token(char ch)
+      : kind_(ch)
+      , value_(0)
+      , name_("")
+    {
+    }
+    token(Num val)
+      : kind_(number)    // let ‘9’ represent “a number”
+      , value_(val)
+      , name_("")
+    {
+    }
+    token(char ch, Num val)
+      : kind_(ch)
+      , value_(val)
+      , name_("")
+    {
+    }
+    token(char ch, std::string nm) 
+    {
+        name_ = nm; 
+        kind_ = ch; 
+        value_ = 0; 
+    }
+    token(char ch, Num val, std::string nm) 
+    {
+        name_ = nm; 
+        kind_ = ch; 
+        value_ = val;
+    }
+    
+    char kind() const
+    {
+        return kind_;
+    }
+    Num value() const
+    {
+        return value_;
+    }
+    std::string getname() const
+    {
+        return name_;
+    }
+};
+
+// Function stuff
+// user functions are compiled to code for a stack machine. A call's frame is its argument slots followed
+// by the temporaries the body pushes, frames sit on a stack preallocated by the session
+enum opcode : unsigned char
+{
+    op_push,    // push value
+    op_arg,     // push frame slot a
+    op_add,     // pop the right then the left operand, push the result
+    op_sub,
+    op_mul,
+    op_div,
+    op_mod,
+    op_pow,
+    op_neg,     // negate the top
+    op_call,    // call function a, its arguments on top of the stack are replaced by the result
+    op_drop,    // drop the a values under the top, the arguments of an inlined call
+    // kernels put in by select_kernels(), the fused ones round once where the plain ops round twice
+    op_muladd,  // a*b+c with a, b, c on the stack in that order, as one fma
+    op_mulsub,  // a*b-c
+    op_addmul,  // c+a*b with c, a, b on the stack in that order
+    op_submul,  // c-a*b
+    op_square,  // square the top
+    op_recip    // replace the top by 1 over it
+};
+
+template<typename Num>
+struct instr
+{
+    opcode op;
+    unsigned a;         // slot, function index or count
+    Num value;          // for op_push
+};
+
+template<typename Num>
+struct user_function
+{
+    std::string name;
+    std::vector<std::string> params;
+    std::vector<instr<Num>> code;
+    size_t need;        // stack slots a call uses, arguments and nested frames included
+};
+
+// read-mostly table of published constants shared by many sessions, possibly on different threads
+// every publish installs a new immutable version of the table. Readers are wait-free: a lookup announces
+// the current epoch in the reader's own slot, loads the table pointer and searches it, and never waits on
+// a writer. Writers are serialized by a mutex and free an old version only once no announced reader epoch
+// could still be using it (epoch based reclamation)
+template<typename Num>
+class shared_namespace
+{
+public:
+    static const int MAX_READERS = 256;     // sessions that can be attached at once
+
+private:
+    // one immutable version of the table, entries sorted by name
+    struct table
+    {
+        std::vector<std::pair<std::string,Num>> entries;
+    };
+    // retired version waiting for readers to move on
+    struct retired
+    {
+        const table* tab;
+        unsigned long long epoch;   // freeable once every active reader has announced this epoch or later
+    };
+    // a reader's announced epoch, on its own cache line so readers don't contend
+    struct alignas(64) reader_slot
+    {
+        std::atomic<unsigned long long> epoch;
+    };
+    static const unsigned long long FREE = 0;   // slot states, announced epochs start at 2
+    static const unsigned long long IDLE = 1;
+
+    std::atomic<const table*> current;
+    std::atomic<unsigned long long> global_epoch;
+    mutable reader_slot slots[MAX_READERS];     // readers announce through const lookups
+    std::mutex writer;                  // serializes publish() and reclamation, never taken by readers
+    std::vector<retired> retired_list;
+
+    // free retired versions no active reader can still see, caller holds writer
+    void reclaim()
+    {
+        unsigned long long oldest = global_epoch.load();
+        for (int i=0; i<MAX_READERS; i++)
+        {
+            unsigned long long e = slots[i].epoch.load();
+            if (e>IDLE && e<oldest)
+                oldest = e;
+        }
+        size_t kept = 0;
+        for (size_t i=0; i<retired_list.size(); i++)
+        {
+            if (retired_list[i].epoch<=oldest)
+                delete retired_list[i].tab;
+            else
+                retired_list[kept++] = retired_list[i];
+        }
+        retired_list.resize(kept);
+    }
+
+public:
+    shared_namespace()
+      : current(new table())
+      , global_epoch(2)
+    {
+        for (int i=0; i<MAX_READERS; i++)
+            slots[i].epoch.store(FREE);
+    }
+    ~shared_namespace()
+    {
+        delete current.load();
+        for (size_t i=0; i<retired_list.size(); i++)
+            delete retired_list[i].tab;
+    }
+    shared_namespace(const shared_namespace&) = delete;
+    shared_namespace& operator=(const shared_namespace&) = delete;
+
+    // claim a reader slot for a session, throws if all MAX_READERS are taken
+    int attach()
+    {
+        for (int i=0; i<MAX_READERS; i++)
+        {
+            unsigned long long expect = FREE;
+            if (slots[i].epoch.compare_exchange_strong(expect, IDLE))
+                return i;
+        }
+        throw std::runtime_error("Too many sessions attached to the shared namespace");
+    }
+    void detach(int slot)
+    {
+        slots[slot].epoch.store(FREE);
+    }
+
+    // wait-free lookup from the reader holding slot, false if name hasn't been published
+    bool lookup(int slot, const std::string& name, Num& value) const
+    {
+        reader_slot& rs = slots[slot];
+        rs.epoch.store(global_epoch.load());
+        const table* tab = current.load();
+        bool found = false;
+        size_t lo = 0, hi = tab->entries.size();   // binary search on the sorted entries
+        while (lo<hi)
+        {
+            size_t mid = (lo+hi)/2;
+            if (tab->entries[mid].first<name)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        if (lo<tab->entries.size() && tab->entries[lo].first==name)
+        {
+            value = tab->entries[lo].second;
+            found = true;
+        }
+        rs.epoch.store(IDLE);
+        return found;
+    }
+
+    // copy of every published entry, sorted by name, for listings
+    std::vector<std::pair<std::string,Num>> snapshot(int slot) const
+    {
+        reader_slot& rs = slots[slot];
+        rs.epoch.store(global_epoch.load());
+        std::vector<std::pair<std::string,Num>> copy = current.load()->entries;
+        rs.epoch.store(IDLE);
+        return copy;
+    }
+
+    // atomically install a new version with name set to value
+    void publish(const std::string& name, Num value)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        const table* old = current.load();
+        table* next = new table(*old);
+        size_t i = 0;
+        while (i<next->entries.size() && next->entries[i].first<name)
+            i++;
+        if (i<next->entries.size() && next->entries[i].first==name)
+            next->entries[i].second = value;
+        else
+            next->entries.insert(next->entries.begin()+i, std::make_pair(name,value));
+        current.store(next);
+        // readers that loaded old announced an epoch from before this increment
+        retired_list.push_back({old, global_epoch.fetch_add(1)+1});
+        reclaim();
+    }
+};
+
+template<typename Num>
+class token_stream
+{
+    // representation: not directly accessible to users:
+    bool full;          // is there a token in the buffer?
+    token<Num> buffer;  // here is where we keep a Token put back using
+                        // putback()
+    const uservar_table<Num>& vars;         // user variables of the owning session, to resolve names
+    const std::vector<user_function<Num>>& funcs;   // user functions of the owning session
+    std::istream* in;   // where tokens are read from
+    const shared_namespace<Num>* shared;    // published constants, looked up after user variables
+    int slot;                               // this session's reader slot in shared
+
+    token<Num> read();  // lex the next token from the input
+public:
+    bool timed;                     // when set, time spent lexing is summed into lexed
+    const std::vector<std::string>* params; // parameters of the function being compiled, nullptr otherwise
+    std::chrono::nanoseconds lexed; // for tracing, reset by the session per statement
+
+    // user interface:
+    token<Num> get();            // get a token from the input
+    void putback(token<Num>);    // put a token back into the token_stream
+    void ignore(char c);         // discard tokens up to and including a c
+    void skip_prints();          // discard ';'s and whitespace up to the next token, waiting for input if needed
+    void set_input(std::istream& input)
+    {
+        in = &input;
+        full = false;           // a buffered token belongs to the old input
+    }
+    std::istream& input() const
+    {
+        return *in;
+    }
+    void set_shared(const shared_namespace<Num>* ns, int readerSlot)
+    {
+        shared = ns;
+        slot = readerSlot;
+    }
+    // value of a published constant, false if there is no namespace or no such name
+    bool get_shared(const std::string& name, Num& value) const
+    {
+        return shared!=nullptr && shared->lookup(slot, name, value);
+    }
+
+    // constructor: make a token_stream, the buffer starts empty
+    token_stream(const uservar_table<Num>& uvars, const std::vector<user_function<Num>>& functions, std::istream& input)
+      : full(false)
+      , buffer(empt)
+      , vars(uvars)
+      , funcs(functions)
+      , in(&input)
+      , shared(nullptr)
+      , slot(-1)
+      , timed(false)
+      , params(nullptr)
+      , lexed(0)
+    {
+    }
+};
+
+// Tracing stuff
+// one traced statement, times are nanoseconds since the tracer was created
+struct trace_event
+{
+    long long index;        // statement number in the session, from 0
+    long long offset;       // input offset the statement started at, -1 if the input can't tell
+    long long start;        // when the statement started
+    long long lex;          // time spent lexing, summed over the token reads of the statement
+    long long total;        // whole statement, lex + parse + eval
+    bool failed;            // statement ended in an error
+};
+
+// records statement spans into a fixed size ring buffer, the oldest events are overwritten
+// dump() writes Chrome Trace Event JSON, which chrome://tracing and Perfetto load directly
+class session_tracer
+{
+    std::vector<trace_event> ring;
+    size_t next;            // slot the next event goes into
+    size_t count;           // number of valid events, at most ring.size()
+    long long sample;       // record every sample'th statement
+    std::chrono::steady_clock::time_point origin;
+
+public:
+    session_tracer(size_t capacity = 65536, long long sampleEvery = 1)
+      : ring(capacity)
+      , next(0)
+      , count(0)
+      , sample(sampleEvery<1 ? 1 : sampleEvery)
+      , origin(std::chrono::steady_clock::now())
+    {
+    }
+
+    bool sampled(long long index) const
+    {
+        return index%sample==0;
+    }
+    long long since_origin(std::chrono::steady_clock::time_point t) const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t-origin).count();
+    }
+    void record(const trace_event& ev)
+    {
+        ring[next] = ev;
+        next = (next+1)%ring.size();
+        if (count<ring.size())
+            count++;
+    }
+    void dump(std::ostream& out) const;
+};
+
+// streambuf over another streambuf that keeps count of what has been read, so tellg() gives a
+// source offset even when the input is a pipe. Installed on std::cin when tracing
+class offset_buf : public std::streambuf
+{
+    std::streambuf* src;
+    char buf[4096];
+    long long base;         // input offset of buf[0]
+
+protected:
+    int_type underflow() override
+    {
+        // keep the last character so putback() across a refill still works
+        size_t keep = 0;
+        if (gptr()!=nullptr && gptr()>eback())
+        {
+            buf[0] = gptr()[-1];
+            keep = 1;
+        }
+        base += (gptr()!=nullptr ? gptr()-eback() : 0) - keep;
+        std::streamsize n = src->sgetn(buf+keep, sizeof(buf)-keep);
+        setg(buf, buf+keep, buf+keep+n);
+        if (n<=0)
+            return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+    {
+        if (off!=0 || dir!=std::ios_base::cur || !(which&std::ios_base::in))
+            return pos_type(off_type(-1));      // only position queries are supported
+        return pos_type(base+(gptr()-eback()));
+    }
+
+public:
+    offset_buf(std::streambuf* source)
+      : src(source)
+      , base(0)
+    {
+        setg(buf, buf, buf);
+    }
+};
+
+// Journal stuff
+// append-only binary log of a session's changes to its user variables, for rebuilding the session
+// with calculator::replay() without running its statements again. The file is a header, "CCJ1" and
+// the byte size of the values, then records in native byte order: kind, name length (4 bytes),
+// name, and for sets the value
+char const JOURNAL_SET = 'S';       // name set to value, created if needed
+char const JOURNAL_DEL = 'D';       // name deleted
+char const JOURNAL_CLEAR = 'C';     // every user variable deleted, no name
+
+// records are buffered and a background thread writes and fsyncs whatever has gathered once per
+// commit interval, so the statements of an interval share one fsync (group commit). A torn record
+// left at the end of the file by a crash is cut off when the journal is opened again
+class session_journal
+{
+    int fd;
+    size_t valueSize;
+    std::chrono::milliseconds interval;
+    std::mutex lock;
+    std::condition_variable wake;       // the writer waits on this for its interval or a flush
+    std::condition_variable written;    // flush() waits on this for the writer
+    std::string pending;                // appended, not yet written
+    unsigned long long appended;        // bytes appended and bytes on disk, since the journal was opened
+    unsigned long long durable;
+    bool flushing;
+    bool stopping;
+    std::string error;                  // set when a write or fsync fails, later calls throw it
+    std::thread writer;
+
+    void write_loop();
+
+public:
+    // open path for appending, creating it if needed. Throws std::runtime_error if it can't be
+    // opened or holds a journal of another value size
+    session_journal(const std::string& path, size_t bytesPerValue, std::chrono::milliseconds commitEvery = std::chrono::milliseconds(10));
+    ~session_journal();     // writes out everything appended
+    session_journal(const session_journal&) = delete;
+    session_journal& operator=(const session_journal&) = delete;
+
+    void append(char kind, const std::string& name, const void* value);     // value is null unless kind is JOURNAL_SET
+    void flush();           // wait until everything appended so far is on disk
+
+    // the record starting at data[pos], false if there is no complete record there. On success
+    // pos moves past it and value points into data (null unless kind is JOURNAL_SET)
+    static bool read_record(const std::string& data, size_t& pos, size_t bytesPerValue, char& kind, std::string& name, const char*& value);
+    static size_t check_header(const std::string& data, size_t bytesPerValue);     // header size, throws if it isn't one
+};
+
+// limits on a single statement, zero means no limit
+struct calc_budget
+{
+    unsigned long long max_ops;     // evaluator steps: each primary and each pass of the '%' loop
+    std::chrono::nanoseconds time;  // wall clock time
+};
+
+// evaluator steps counted against a statement's budget. The session counts on its own meter, the worker
+// threads of a reduction each on one whose count is added to a shared total at every check
+struct step_meter
+{
+    unsigned long long ops;         // steps counted here
+    unsigned long long next_check;  // ops count at which check_budget() runs next
+    std::atomic<unsigned long long>* pool;  // total of a reduction's workers, nullptr for the session's meter
+    unsigned long long pooled;      // part of ops already added to pool
+};
+
+// thrown when a statement runs out of budget or is cancelled, statement() turns it into an error result
+class budget_error : public std::runtime_error
+{
+    int code_;      // CALC_ERR_BUDGET or CALC_ERR_CANCELLED
+
+public:
+    budget_error(int code, const char* what)
+      : std::runtime_error(what)
+      , code_(code)
+    {
+    }
+    int code() const
+    {
+        return code_;
+    }
+};
+
+// outcome of one statement, returned by calculator::statement()
+template<typename Num>
+struct calc_result
+{
+    int code;           // CALC_OK or one of the CALC_ERR_ codes from consolecalc.h
+    char kind;          // kind of token that started the statement: number for a value, setvar, disp, del, help or quit
+    Num value;          // value of the expression or the value assigned, for quit 1 at the end of the input and 0 for 'q'
+    std::string name;   // variable created, updated or deleted
+    std::string error;  // error message when code isn't CALC_OK
+};
+
+// the evaluation engine, one instance holds a session's token_stream and user variables
+// templated on the numeric type so float/double/long double engines come from the same source
+template<typename Num>
+class calculator
+{
+    uservar_table<Num> userVars;            // current user defined variables
+    std::vector<user_function<Num>> functions;  // user functions, a redefinition is added and shadows the old one
+    std::vector<Num> callstack;             // frames of user function calls, allocated with the first def
+    size_t csp;                             // first free slot of callstack
+    std::ostream* out;                      // messages and listings go here, dropped when nullptr
+    token_stream<Num> ts;                   // the session's token_stream, reads through userVars
+    session_tracer* tracer;                 // optional, records per-statement spans when set
+    long long stmt;                         // statements run so far, for tracing
+    long long inputBase;                    // offset of the current input in the whole source, for tracing
+    shared_namespace<Num>* shared;          // optional namespace of published constants
+    int slot;                               // reader slot held in shared
+    calc_budget budget;                     // per-statement limits
+    std::atomic<bool>* cancel;              // optional cancellation flag, set from another thread or a signal handler
+    session_journal* journal;               // optional log of changes to user variables
+    step_meter steps;                       // evaluator steps in the current statement
+    unsigned threads;                       // threads a reduction may use, 0 for one per hardware thread
+    Num (calculator::*runner)(const user_function<Num>&, Num*, step_meter&);  // run_fma() on CPUs with FMA, else run_portable()
+    std::chrono::steady_clock::time_point deadline;
+
+    // count one evaluator step, only every CHECK_EVERY steps (or at the op limit) costs more than an increment
+    void tick(step_meter& m)
+    {
+        if (++m.ops>=m.next_check)
+            check_budget(m);
+    }
+    void tick()
+    {
+        tick(steps);
+    }
+    void check_budget(step_meter& m);   // throws budget_error when the statement is over budget or cancelled
+    void start_budget();    // reset the counters once a statement's first token has been read
+
+    Num primary();          // Number or '(' Expression ')', negatives and '^'
+    Num negated_power(Num v);   // -v, raised to the next primary when a '^' follows
+    Num term();             // '*', '/', '%' and '^'
+    Num expression();       // '+' and '-'
+    void clean_up_mess();   // skip to the end of a bad expression
+    Num modulo(Num left, Num d, step_meter& m);     // left % d, by repeated subtraction
+
+    // state while compiling one function body
+    struct codegen
+    {
+        std::vector<instr<Num>> code;
+        size_t nparams;     // frame slots below the temporaries
+        size_t depth;       // temporaries on the stack at the current point
+        size_t need;        // most frame slots in use at once, nested frames included
+    };
+    void define(const std::string& name);   // read the parameters and body of a def and compile it
+    void compile_primary(codegen& cg);      // the same grammar as primary(), term() and expression(),
+    void compile_term(codegen& cg);         // emitting code rather than evaluating
+    void compile_expression(codegen& cg);
+    void compile_power(codegen& cg);        // a '^' after an operand
+    void compile_call(codegen& cg, size_t f);   // arguments and call of function f, small bodies are inlined
+    void emit(codegen& cg, opcode op, unsigned a = 0, Num value = 0);  // append an instruction, folding constants
+    size_t select_kernels(std::vector<instr<Num>>& code, size_t nparams) const;  // rewrite finished code with fused opcodes, returns its need
+    Num call_function(size_t f);            // read the arguments of a call from the input and run it
+    Num run(const user_function<Num>& fn, Num* frame, step_meter& m)  // run fn with its arguments in frame
+    {
+        return (this->*runner)(fn, frame, m);
+    }
+    __attribute__((always_inline)) Num interpret(const user_function<Num>& fn, Num* frame, step_meter& m);   // the loop, built into both:
+    Num run_portable(const user_function<Num>& fn, Num* frame, step_meter& m);
+    CALC_FMA_TARGET Num run_fma(const user_function<Num>& fn, Num* frame, step_meter& m);
+
+    Num reduction(int which);               // read and evaluate "(i, from, to, [step,] body)" of a reduction
+    Num reduce_range(int which, const user_function<Num>& body, Num from, Num step, unsigned long long count);
+    Num reduce_block(int which, const user_function<Num>& body, Num from, Num step,
+                     unsigned long long first, unsigned long long last, Num* frame, step_meter& m);
+    void display(int flag); // listings for the display command
+
+public:
+    calculator(std::istream& input = std::cin, std::ostream* output = &std::cout)
+      : csp(0)
+      , out(output)
+      , ts(userVars, functions, input)
+      , tracer(nullptr)
+      , stmt(0)
+      , inputBase(0)
+      , shared(nullptr)
+      , slot(-1)
+      , budget({0, std::chrono::nanoseconds(0)})
+      , cancel(nullptr)
+      , journal(nullptr)
+      , steps({0, 0, nullptr, 0})
+      , threads(0)
+      , runner(cpu_has_fma() ? &calculator::run_fma : &calculator::run_portable)
+    {
+    }
+    ~calculator()
+    {
+        set_shared(nullptr);
+    }
+
+    void set_input(std::istream& input)
+    {
+        ts.set_input(input);
+    }
+    void set_output(std::ostream* output)
+    {
+        out = output;
+    }
+    void set_tracer(session_tracer* tr)
+    {
+        tracer = tr;
+    }
+    void set_budget(const calc_budget& b)
+    {
+        budget = b;
+    }
+    // log every change to the user variables to j (nullptr to stop), which must outlive the attachment
+    void set_journal(session_journal* j)
+    {
+        journal = j;
+    }
+    // threads for sum, prod, min and max over long ranges, 0 (the default) for one per hardware thread
+    void set_threads(unsigned n)
+    {
+        threads = n;
+    }
+    // flag that cancels the running statement when set, cleared as each statement's first token is read
+    void set_cancel(std::atomic<bool>* flag)
+    {
+        cancel = flag;
+    }
+    // attach the session to a shared namespace (nullptr to detach), which must outlive the attachment
+    void set_shared(shared_namespace<Num>* ns)
+    {
+        if (shared!=nullptr)
+            shared->detach(slot);
+        shared = ns;
+        slot = ns!=nullptr ? ns->attach() : -1;
+        ts.set_shared(shared, slot);
+    }
+
+    calc_result<Num> statement();   // read and run the next statement from the input
+    int evaluate(const std::string& src, std::vector<calc_result<Num>>& results, long long base = 0);    // run every statement in src
+    bool get_var(const std::string& name, Num& value) const;
+    int set_var(const std::string& name, Num value);    // creates the variable if needed
+    unsigned long long replay(const std::string& path); // apply a journal's records to the user variables
+};
+
+// the engines are compiled once into the library
+extern template class calculator<float>;
+extern template class calculator<double>;
+extern template class calculator<long double>;
+
+#endif // CALC_ENGINE_H
@@ -3,965 +3,435 @@
 #include <istream>
 #include <stdexcept>
 #include <string>
-#include <cstring>
-#include <cassert>      
 #include <algorithm>
-#include <format>
 #include <vector>
-#include <set>
 #include <sstream>
-#include <math.h>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <memory>
+#include "calc_engine.h"
+#include "consolecalc.h"
 
-#define NUM_OP 10            // number of accepted operators
-#define NUM_SYSVAR 4        // to allow easier modifiability if new constants are added
-#define NUM_COMMAND 5       // numbers of protected command names
-#define NUM_OPTIONS 4       // number of option/target keywords
-
-// doubles for vals
-const double DISP_SYS =   1.0; // 2^0               // command pass values
-const double DISP_USER =  2.0; // 2^1              // doubles so will be accepted as values
-const double DISP_ALL =   4.0; // 2^2
-const double DISP_OP =    8.0; // 2^3
-
-const double DELETE_ALL= -1.0;
-
-// ints for flag switch
-const int DISP_SYS_FLAG =   1;
-const int DISP_USER_FLAG =  2;
-const int DISP_ALL_FLAG =   4;
-const int DISP_OP_FLAG =    8;
-
-const int DELETE_ALL_FLAG= -1;
-
-
-
-// Token stuff
-// Token “kind” values:
-char const number = '9';    // a floating-point number is now 9, because we've gone beyond only positives
-char const quit = 'q';      // an exit command
-char const print = ';';     // a print command
-char const help = 'h';      // display help text
-char const disp = 'd';      // a command to display variables, either system, user, or all
-char const del = 'k';       // a command to delete user variables
-char const setvar = 'v';    // a token assigning a variable, either adding to the set or overwriting
-char const empt = '\0';       // a default value for kind_ in token, on resolve will throw an error
-
-    // could define these constants as well, but I prefer the variables for the user-facing system constants
-const double e = 2.718281828459045;     
-const double g = 9.80665;       // gravitational constant
-const double phi = 1.6180339887;
-const double pi = 3.1415926535;
-const double syscons[NUM_SYSVAR] = {e,g,phi,pi};
-// if extending system constants, list constants first in reservedVarNames, then all commands, then all options/targets
-const std::string reservedVarNames[NUM_SYSVAR+NUM_COMMAND+NUM_OPTIONS] = {"e","g","phi","pi",     "help","q","quit","delete","display",        "sysvars","uvars","all","operators"}; 
-const char operators[NUM_OP] = {'(',')',';','=','+','-','*','/','%','^'};
-const char* opdescrip[NUM_OP] = {"Open parentheses","Close parentheses","Print","Assign a user variable","Add","Subtract/Negative","Multiply","Divide","Modulo","Power/Raise"};
+// User interaction strings:
+char const prompt[] = "Enter one or more expressions to evaluate, ending each expression with ';' (Enter 'q;' or 'quit;' to quit, or 'help;' for more info) > ";
+char const result[] = "= ";    // indicate that a result follows
 
-// helper functions
-const std::string lowcase(const std::string str);   // creates a lowercase string of input
-bool is_op(const char ch);                         // checks if ch is an operator character
-bool is_sysvar(const std::string varName);          // checks if varName is a system constant
-const double get_sysvar(const std::string varName); // returns value of matching system constant
-bool is_command(const std::string varName);         // checks if varName is a command
-bool is_option(const std::string varName);          // checks if varName is a valid option/target
-const double get_option(const std::string varName); // returns the appropriate option value for tokens
-bool is_usrvar(const std::string varName);          // checks is user variable varName exists
-const double get_usrvar(const std::string varName); // gets value of matching user variable
-bool is_break(const char ch);                       // checks if ch is a break character
+// Ctrl-C cancels the running statement, a second Ctrl-C before a new statement starts quits
+std::atomic<bool> interrupted(false);
 
-// class for user defined variables
-class UserVar 
+extern "C" void on_interrupt(int)
 {
-    std::string name;   // the set name for the variable
-    double val;       // its current value
+    if (interrupted.exchange(true))
+        std::_Exit(130);
+}
 
-public:
-    // constructors
-    UserVar()
-    {
-        name = "";
-        val = 0;
-    }
-    UserVar(const std::string nm, const double v) 
-    {
-        name=nm; 
-        val=v;
-    }
-    UserVar(const std::string nm) 
-    {
-        name=nm; 
-        val=0;
-    }
-    // return funcs
-    std::string sname() const 
-    {
-        return name;
-    }
-    const char* cname() const 
-    {
-        return name.c_str();
-    }
-    double getvalue() const 
+// prompt/evaluate loop on std::cin, the engine does the work and writes its own messages and listings
+template<typename Num>
+void calculate(calculator<Num>& calc)
+{
+    while (std::cin)
     {
-        return val;
+        std::cout << prompt;    // print prompt
+        calc_result<Num> res = calc.statement();
+        if (res.code!=CALC_OK)
+            std::cerr << res.error << std::endl;    // write error message
+        else if (res.kind==quit)
+            return;
+        else if (res.kind==number)
+            std::cout << result << res.value << std::endl;
     }
+}
 
-    // set funcs
-    void setvalue(double v) 
-    {
-        val = v;
-    }
-    void setname(std::string nm) 
+// -e mode: run every statement in src with no prompt or messages, printing each expression's value on its own line
+// errors go to std::cerr, returns the exit code, 0 if every statement ran and 1 otherwise
+template<typename Num>
+int run_once(calculator<Num>& calc, const std::string& src)
+{
+    std::vector<calc_result<Num>> results;
+    calc.set_output(nullptr);
+    int code = calc.evaluate(src, results);
+    for (size_t i=0; i<results.size(); i++)
     {
-        name = nm;   // mainly for testing
+        if (results[i].code!=CALC_OK)
+            std::cerr << results[i].error << '\n';
+        else if (results[i].kind==number)
+            std::cout << results[i].value << '\n';
     }
-
-    // overload relational operators
-    bool operator<(const UserVar& rhs) {return (name < rhs.name);}
-    bool operator>(const UserVar& rhs) {return (name > rhs.name);}
-    bool operator==(const UserVar& rhs) {return (name==rhs.name);}
-    bool operator>=(const UserVar& rhs) {return !(*this<rhs);}
-    bool operator<=(const UserVar& rhs) {return !(*this>rhs);}
-    bool operator!=(const UserVar& rhs) {return !(*this==rhs);}
-    // for c string inputs
-    bool operator<(const char* cstr) const {return (strcmp(name.c_str(), cstr)<0);}    //strcmp, if first is less than second
-    bool operator>(const char* cstr) const {return (strcmp(name.c_str(), cstr)>0);}    // returns negative. If equal, returns 0
-    bool operator==(const char* cstr) const {return (strcmp(name.c_str(), cstr)==0);} // If first greater, returns positive
-};
-
-
-// standalone operator overloads for ordering
-bool operator<(const UserVar& lhs, const UserVar& rhs){
-    return lhs.cname() < rhs.cname();
+    return code==CALC_OK ? 0 : 1;
 }
-bool operator>(const UserVar& lhs, const UserVar& rhs){
-    return lhs.cname() > rhs.cname();
-}
-bool operator==(const UserVar& lhs, const UserVar& rhs){
-    return (strcmp(lhs.cname() ,rhs.cname())==0);
-}
-bool operator>=(const UserVar& lhs, const UserVar& rhs){
-    return !(lhs<rhs);
-}
-bool operator<=(const UserVar& lhs, const UserVar& rhs){
-    return !(lhs>rhs);
-}
-bool operator!=(const UserVar& lhs, const UserVar& rhs){
-    return !(lhs==rhs);
-}
-
-// vector to store reserved variable names, initialized by const array
-std::vector<std::string> vecReservedNames (reservedVarNames, reservedVarNames+NUM_SYSVAR+NUM_COMMAND);
 
-// extended to include a name to preserve for user variable assignments
-class token
+// bounded single-producer/single-consumer ring, lock-free: only the producer writes tail and only the
+// consumer writes head. A full push() or empty pop() sleeps on the other side's index instead of spinning
+template<typename T>
+class spsc_ring
 {
-    char kind_;       // what kind of token
-    double value_;    // for numbers: a value
-    std::string name_;// for variable assignments
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head;   // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail;   // next slot to push, written by the producer
 
 public:
-    // constructors
-    token()
-      : kind_(empt)      // 'err' = '\0', should only occur in improperly initialized tokens
-      , value_(0)
-      , name_("")
-    {
-    }
-    token(char ch)
-      : kind_(ch)
-      , value_(0)
-      , name_("")
-    {
-    }
-    token(double val)
-      : kind_(number)    // let ‘9’ represent “a number”
-      , value_(val)
-      , name_("")
-    {
-    }
-    token(char ch, double val)
-      : kind_(ch)
-      , value_(val)
-      , name_("")
-    {
-    }
-    token(char ch, std::string nm) 
-    {
-        name_ = nm; 
-        kind_ = ch; 
-        value_ = 0; 
-    }
-    token(char ch, double val, std::string nm) 
-    {
-        name_ = nm; 
-        kind_ = ch; 
-        value_ = val;
-    }
-    
-    char kind() const
+    spsc_ring(size_t capacity)
+      : slots(capacity)
+      , head(0)
+      , tail(0)
     {
-        return kind_;
     }
-    double value() const
+
+    void push(T&& item)
     {
-        return value_;
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        while (t-h==slots.size())       // full, wait for the consumer to take one
+        {
+            head.wait(h, std::memory_order_acquire);
+            h = head.load(std::memory_order_acquire);
+        }
+        slots[t%slots.size()] = std::move(item);
+        tail.store(t+1, std::memory_order_release);
+        tail.notify_one();
     }
-    std::string getname() const
+    T pop()
     {
-        return name_;
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        while (t==h)                    // empty, wait for the producer
+        {
+            tail.wait(t, std::memory_order_acquire);
+            t = tail.load(std::memory_order_acquire);
+        }
+        T item = std::move(slots[h%slots.size()]);
+        head.store(h+1, std::memory_order_release);
+        head.notify_one();
+        return item;
     }
 };
 
-// User interaction strings:
-std::string const prompt = "Enter one or more expressions to evaluate, ending each expression with ';' (Enter 'q;' or 'quit;' to quit, or 'help;' for more info) > ";
-std::string const helptext = "Symbols and commands: \n ; - Use to signify the end of a single expression and parse all input \n q or quit - Quit program \n help; - Display this help text \n display sysvars; - Display a list of built in system variables \n display uvars; - Display a list of current user variables \n display all; - Display a list of all current variables \n display operators; - Display a list of accepted operators \n delete uvars all; - Delete all current user variables \n delete uvars $name; - Delete user variable with name matching $name \n\n User variables must include only alpha characters.\n\n User Variable names are case sensitive, system constants and commands are not. \n To assign a variable, use 'varname = ($expression);'\n\n";
-std::string const result = "= ";    // indicate that a result follows
-
-class token_stream
+// batch mode passes these between its stages
+struct stmt_batch
 {
-    // representation: not directly accessible to users:
-    bool full;       // is there a token in the buffer?
-    token buffer;    // here is where we keep a Token put back using
-                     // putback()
-public:
-    // user interface:
-    token get();            // get a token from std::cin
-    void putback(token);    // put a token back into the token_stream
-    void ignore(char c);    // discard tokens up to and including a c
-
-    // constructor: make a token_stream, the buffer starts empty
-    token_stream()
-      : full(false)
-      , buffer(empt)
-    {
-    }
+    std::string text;       // whole statements, the batch ends on a ';' unless it is the last
+    bool last;              // no more batches follow
 };
-
-// single global instance of the token_stream
-token_stream ts;
-// global vector to store current user defined variables 
-std::vector<UserVar> vecUserVars;
-
-void token_stream::putback(token t)
+template<typename Num>
+struct result_batch
 {
-    if (full)
-        throw std::runtime_error("putback() into a full buffer");
-    buffer = t;
-    full = true;
-}
+    std::vector<calc_result<Num>> results;
+    bool last;
+};
 
-// declaration so that primary() and ts.get() can call expression()
-double expression();
+const size_t BATCH_BYTES = 64*1024;     // input read per batch
+const size_t RING_SLOTS = 8;            // batches in flight between two stages
 
-token token_stream::get()    // read a token from the token_stream
+// --batch mode: output like -e, but the input is pipelined through three threads so reading, evaluation and
+// writing overlap: read+split -> lex+parse+eval -> format+write. Lexing stays with evaluation because it
+// resolves names against the variables earlier statements created. Returns the exit code like run_once()
+template<typename Num>
+int run_batch(calculator<Num>& calc)
 {
-    // check if we already have a Token ready
-    if (full)
-    {
-        full = false;
-        return buffer;
-    }
-
-    // note that >> skips whitespace (space, newline, tab, etc.)
-    char ch;      // ch for cin
-    std::string vrname, optname; // for constructing names
-    vrname.clear();
-    optname.clear();
-    std::cin >> ch;
-
-    // operator check
-    if (is_op(ch))    // is an operator 
-        return token(ch);
-    if (is_break(ch))   // from cin, can't be ' ', all other breaks should cause print tokens
-        return token(print);
-
-    // now numbers
-    if (isdigit(ch) || ch=='.')
-    {
-        std::cin.putback(ch);
-        double val;
-        std::cin >> val;
-        return token(val);
-    }
+    spsc_ring<stmt_batch> statements(RING_SLOTS);
+    spsc_ring<result_batch<Num>> results(RING_SLOTS);
+    std::atomic<bool> stop(false);      // set on 'q', the reader stops early
 
-    if (isalpha(ch)) // starts with character, either existing variable or assign
+    // stage 1: read the input and cut it after the last ';' of each block, so no statement spans two batches
+    std::thread reader([&]()
     {
-        while (isalpha(ch))
+        std::streambuf* src = std::cin.rdbuf();
+        std::vector<char> buf(BATCH_BYTES);
+        std::string pending;
+        while (!stop.load(std::memory_order_relaxed))
         {
-            vrname.push_back(ch);
-            std::cin.get(ch);
+            std::streamsize n = src->sgetn(buf.data(), buf.size());
+            if (n<=0)
+                break;
+            pending.append(buf.data(), n);
+            size_t end = pending.rfind(';');
+            if (end==std::string::npos)     // no complete statement yet
+                continue;
+            stmt_batch b = {pending.substr(0, end+1), false};
+            pending.erase(0, end+1);
+            statements.push(std::move(b));
         }
-        std::cin.putback(ch);
-        if (is_command(lowcase(vrname))) // a command
+        statements.push({pending, true});   // the rest, which may be an unterminated statement
+    });
+
+    // stage 3: format the results and write them out a batch at a time
+    std::thread writer([&]()
+    {
+        std::ostringstream values, errors;
+        while (true)
         {
-            std::string cmnd = lowcase(vrname);
-            if (cmnd=="q"||cmnd=="quit")
-            {
-                return token(quit);
-            }
-            if (cmnd=="help")
+            result_batch<Num> b = results.pop();
+            values.str("");
+            errors.str("");
+            for (size_t i=0; i<b.results.size(); i++)
             {
-                return token(help);
+                if (b.results[i].code!=CALC_OK)
+                    errors << b.results[i].error << '\n';
+                else if (b.results[i].kind==number)
+                    values << b.results[i].value << '\n';
             }
-            if (cmnd=="display")
-            {
-                std::cin >> ch;     // continue to check command target
-                while (isalpha(ch))
-                {
-                    optname.push_back(ch);
-                    std::cin.get(ch);
-                }
-                std::cin.putback(ch);
-                std::string tgt = lowcase(optname);
-                if (is_option(tgt))
-                {
-                    double flag = get_option(tgt);
-                    return token(disp,flag);
-                }
-                throw std::runtime_error("Bad argument for display. Options for display are: sysvars;  uvars;  all;  options;");
-            }
-            if (cmnd=="delete")
-            {
-                std::cin >> ch;     // continue to check command target
-                while (isalpha(ch))
-                {
-                    optname.push_back(ch);
-                    std::cin.get(ch);
-                }
-                std::cin.putback(ch);
-                std::string tgt = lowcase(optname);
-                if (tgt=="all")
-                    return token(del,-1);
-                else if (is_usrvar(optname))    // a matching variable exists
-                    return token(del,0,optname);
-                else
-                    throw std::runtime_error("Cannot delete a variable that does not exist!");
-            }
-            // command not in list
-            throw std::runtime_error("Command not found.");
-        }
-        if (is_sysvar(lowcase(vrname))) // a system constant exists
-        {
-            double d = get_sysvar(lowcase(vrname));
-            return token(d);        // resolve constants into number tokens
+            std::cout << values.str();
+            std::cerr << errors.str();
+            if (b.last)
+                break;
         }
-        if (is_usrvar(vrname))      // one exists
+        std::cout.flush();
+    });
+
+    // stage 2 on this thread: lex, parse and evaluate
+    calc.set_output(nullptr);
+    int code = CALC_OK;
+    bool quitting = false;
+    long long consumed = 0;     // input bytes in earlier batches, so traced offsets count from the start of the input
+    while (true)
+    {
+        stmt_batch b = statements.pop();
+        result_batch<Num> r;
+        r.last = b.last;
+        if (!quitting)      // after 'q' the remaining batches are drained unread
         {
-            std::cin >> ch;
-            if (ch=='=')        // gonna assign, make a setvar
+            int c = calc.evaluate(b.text, r.results, consumed);
+            consumed += b.text.size();
+            if (code==CALC_OK)
+                code = c;
+            if (!r.results.empty() && r.results.back().kind==quit)
             {
-                return token(setvar, 1, vrname); // set 1 to take from expression, 0 to 0
+                quitting = true;
+                stop.store(true, std::memory_order_relaxed);
             }
-            else                // just make a number from its value
-            {
-                std::cin.putback(ch);
-                double d = get_usrvar(vrname);
-                return token(d);
-            }
-        }
-        ch = 0; // set to allow end of line to declare new var, e.g. "prompt> var" then enter creates var with value 0
-        std::cin >> ch; // unitiatied variable, check if assign, print, or nothing after, latter 2 set to zero
-        if (ch==0||ch==';')
-        {    // create the user variable with initial value 0
-            return token(setvar,0,vrname);
-        }
-        else if (ch=='=')  // create then assign
-            return token(setvar,1,vrname);
-        else  // trying to use an undeclared variable
-        {
-            std::cin.putback(ch);
-            throw std::runtime_error("Tried to use an undeclared variable!");
         }
+        results.push(std::move(r));
+        if (b.last)
+            break;
     }
-    // should only get here if character or token is unmakeable
-    throw std::runtime_error("Bad token");    
+    reader.join();
+    writer.join();
+    return code==CALC_OK ? 0 : 1;
 }
 
-
-// discard tokens up to and including a c
-void token_stream::ignore(char c)
+#ifdef CALC_BENCH
+// benchmark build (-DCALC_BENCH): runs the same generated session through each engine instantiation
+// and reports statements per second, std::cin/std::cout are redirected so only evaluation is timed
+template<typename Num>
+double bench_engine(const std::string& input, int nstmt)
 {
-    // first look in buffer:
-    if (full && c == buffer.kind())    // && means 'and'
-    {
-        full = false;
-        return;
-    }
-    full = false;    // discard the contents of buffer
-
-    // now search input:
-    char ch = 0;
-    while (std::cin.get(ch))
-    {
-        if (ch == c)
-            break;
-    }
+    std::istringstream in(input);
+    std::ostringstream sink;
+    std::streambuf* oldin = std::cin.rdbuf(in.rdbuf());
+    std::streambuf* oldout = std::cout.rdbuf(sink.rdbuf());
+    calculator<Num> calc;
+    auto start = std::chrono::steady_clock::now();
+    calculate(calc);
+    auto stop = std::chrono::steady_clock::now();
+    std::cin.rdbuf(oldin);
+    std::cout.rdbuf(oldout);
+    std::cin.clear();
+    double secs = std::chrono::duration<double>(stop-start).count();
+    return nstmt/secs;
 }
 
-
-
-double primary()    // Number or ‘(‘ Expression ‘)’ or '-' for negative numbers, or search/set user var. power '^' also managed here 
+int main()
 {
-    char ch;       // for negative usage
-    std::string varname; // for checking existing user variables
-    token t = ts.get();
-    token n;        // to use when checking for - or ^
-    switch (t.kind())
+    const int nstmt = 200000;
+    std::string input = "a = (1.5); b = (2.25); c = (0.75);\n";
+    for (int i=0; i<nstmt; i++)     // polynomial, variable heavy, nested and modulo statements
     {
-        case '(':    // handle ‘(’expression ‘)’
-        {
-            double d = expression();
-            t = ts.get();
-            if (t.kind() != ')')
-                throw std::runtime_error("')' expected");
-            return d;
-            break;          // unnecessary but safe
-        }
-        case '-':   // check if folowing token would be number, if so, read in then make negative
-        {
-            std::cin >> ch;
-            if (ch=='(')
-            {
-                double d = expression();
-                t = ts.get();
-                if (t.kind() != ')')
-                    throw std::runtime_error("')' expected");
-                return d*-1;
-                break;          // unnecessary but safe
-            }
-            if (isdigit(ch) || ch=='.') // next token will be number
-            {
-                std::cin.putback(ch);     // replace ch, read in double, then negate and return
-                double dn;
-                std::cin >> dn;
-                dn *= -1;               // negate        
-                std::cin >> ch;          // now we have a number, must check for power ^
-                if (ch=='^')      // is a raise ^
-                {
-                    double rpower = primary();      // evaluate the primary to be raised to
-                    double result = pow(dn, rpower);   // then raise value to power
-                    return result;      // return, closed out
-                }
-                else                   // not a raise ^
-                {
-                    std::cin.putback(ch);      // put next token into buffer
-                    return dn;          // return, closed out
-                }
-            }
-            else if (isalpha(ch))       // could be user variable
-            {
-                varname.push_back(ch);  // add character to varname
-                while (isalpha(ch))    // get all sequential alpha characters to compose variable name
-                {
-                    varname.push_back(ch);  // keep adding chars
-                    std::cin.get(ch);
-                }
-                std::cin.putback(ch);
-                // First check if varname is a command, if so throw error
-                if (is_command(varname))
-                    throw std::runtime_error("Tried to create primary from command name");
-                // Now to check if variable exists, otherwise throw error
-                if (is_sysvar(varname))
-                {       // is a system constant, so get its value then negate
-                    double sysv = get_sysvar(varname);    
-                    sysv *= -1;             
-                    n = ts.get();           // now we have a number, must check for power ^
-                    if (n.kind()=='^')      // is a raise ^
-                    {
-                        double rpower = primary();      // evaluate the expression to be raised to
-                        double result = pow(sysv, rpower);   // then raise value to power
-                        return result;      // return, closed out
-                    }
-                    else                   // not a raise ^
-                    {
-                        ts.putback(n);      // put next token into buffer
-                        return sysv;          // return, closed out
-                    }
-                }
-                // Now check for user var, if not that either then throw error
-                else if (is_usrvar(varname))    // there is an existing uservar, get its value then negate
-                {
-                    double usrv = get_usrvar(varname);    
-                    usrv *= -1;             
-                    n = ts.get();           // now we have a number, must check for power ^
-                    if (n.kind()=='^')      // is a raise ^
-                    {
-                        double rpower = primary();      // evaluate the primary to be raised to
-                        double result = pow(usrv, rpower);   // then raise value to power
-                        return result;      // return, closed out
-                    }
-                    else                   // not a raise ^
-                    {
-                        ts.putback(n);      // put next token into buffer
-                        return usrv;          // return, closed out
-                    }
-                }
-                else
-                    throw std::runtime_error("Failed to create a negative primary from alpha chars");
-            }
-            break;          // unnecessary but safe
-        }
-        case number:    // since we allow power, we must check for next char being ^
-        {
-            n = ts.get();   // get next token to check for power to preserve precedence
-            if (n.kind()=='^')  // next operator is a raise, must raise to an primary
-            {
-                std::cin >> std::ws;
-                double rpower = primary();             // evaluate the primary to be raised to
-                double result = pow(t.value(), rpower);   // then raise value to power
-                return result;
-            }
-            else        // not a power, treat as normal number
-            {
-                ts.putback(n);       // pushback the token
-                return t.value();    // return the number’s value
-            }
-            break;          // unnecessary but safe
-        }
-        case setvar:    // if valid user variable
-        {
-            return t.value();
-            break;          // unnecessary but safe
-        }
-        default:
+        switch (i%4)
         {
-            std::cout << "Hit default in primary with token " << t.kind() << " " << t.value() << " " << t.getname() << std::endl;
-            throw std::runtime_error("primary expected");
+            case 0: input += "a*b+c*3.5-1.25;\n"; break;
+            case 1: input += "(a-b)*(a-b)/c+pi*2;\n"; break;
+            case 2: input += "((a+1)*(b-2))/(c+4.5)-e;\n"; break;
+            case 3: input += "17.5%4+a*a*a-b;\n"; break;
         }
     }
-    // should only reach here if everything failed, throw error
-    throw std::runtime_error("Reached bottom of primary, something very wrong.");
+    input += "q;\n";
+    std::cout << "Statements per second over " << nstmt << " statements:" << std::endl;
+    std::cout << "float:       " << bench_engine<float>(input, nstmt) << std::endl;
+    std::cout << "double:      " << bench_engine<double>(input, nstmt) << std::endl;
+    std::cout << "long double: " << bench_engine<long double>(input, nstmt) << std::endl;
+    return 0;
 }
-
-// exactly like expression(), but for '*', '/', '%', and '^'
-double term()
+#elif defined(CALC_STRESS)
+// stress build (-DCALC_STRESS): 64 sessions on their own threads read two published constants from the shared
+// namespace while one more session keeps publishing them with increasing values, other first, then counter.
+// Every reader checks that counter never goes down and that other, read after it, is never behind it.
+// usage: calculator [seconds]
+int main(int argc, char* argv[])
 {
-    double left = primary();    // get the Primary
-    while (true)
-    {
-        token t = ts.get();    // get the next Token ...
-        switch (t.kind())
+    const int nreaders = 64;
+    double seconds = argc>1 ? atof(argv[1]) : 2;
+    shared_namespace<calc_num> ns;
+    std::atomic<bool> done(false);
+    std::atomic<long long> reads(0), failures(0), backwards(0);
+    std::atomic<int> ready(0);
+    calculator<calc_num> writer(std::cin, nullptr);
+    writer.set_shared(&ns);
+    std::vector<calc_result<calc_num>> results;
+    writer.evaluate("publish other = (0); publish counter = (0);", results);
+
+    std::vector<std::thread> readers;
+    for (int r=0; r<nreaders; r++)
+    {
+        readers.emplace_back([&]()
         {
-        case '*':
-            left *= primary();
-            break;
-        case '/':
-        {
-            double d = primary();
-            if (d == 0)
-                throw std::runtime_error("divide by zero");
-            left /= d;
-            break;
-        }
-        case '%':       // can't modulo doubles, so I'll just do it manually
-        {
-            double d = primary();
-            if (d==0)
-                throw std::runtime_error("modulo by zero");
-            if (left==0)    // 0 mod anything is still zero, so just grab next token
-                break;
-            if (left<0)     // left side negative
+            calculator<calc_num> calc(std::cin, nullptr);    // nothing is read from std::cin
+            calc.set_shared(&ns);
+            std::vector<calc_result<calc_num>> results;
+            calc_num last = -1;
+            long long n = 0;
+            ready++;
+            while (!done.load(std::memory_order_relaxed))
             {
-                if (d<0)    // both negative
+                results.clear();
+                calc.evaluate("counter; other;", results);
+                for (size_t i=0; i<results.size(); i++)
                 {
-                    while (left<=d)
-                    {
-                        left-=d;    // both negative, will range between (d,0]
-                    }
+                    if (results[i].code!=CALC_OK)
+                        failures++;
                 }
-                else        // right side positive
+                if (results.size()==2 && results[0].code==CALC_OK)
                 {
-                    while (left+d<=0)
-                    {
-                        left +=d;
-                    }
+                    // other is published before counter and read after it, so it is never behind
+                    if (results[0].value<last || results[1].value<results[0].value)
+                        backwards++;
+                    last = results[0].value;
                 }
+                n += 2;
             }
-            else            // left side positive
-            {
-                if (d<0)    // right side negative
-                {
-                    while (left>0)
-                    {
-                        left+=d;    // will range between (d,0] 
-                    }
-                }
-                else        // both positive, trivial case
-                {
-                    while (left>=d)
-                    {
-                        left -=d;
-                    }
-                }
-            } 
-            break; 
-        }
-        case '^':
-        {
-            double d = primary();
-            left = pow(left,d);
-            return left;
-        }
-        default:
-            ts.putback(t);    // <<< put the unused token back
-            return left;      // return the value
-        }
-    }
+            reads += n;
+            calc.set_shared(nullptr);
+        });
+    }
+
+    while (ready.load()<nreaders)
+        std::this_thread::yield();
+    long long writes = 0;
+    auto stop = std::chrono::steady_clock::now()+std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now()<stop)
+    {
+        writes++;
+        std::string k = std::to_string(writes);
+        results.clear();
+        writer.evaluate("publish other = ("+k+"); publish counter = ("+k+");", results);
+    }
+    done.store(true);
+    for (size_t r=0; r<readers.size(); r++)
+        readers[r].join();
+    writer.set_shared(nullptr);
+
+    std::cout << nreaders << " readers, " << reads.load() << " lookups, " << 2*writes << " publishes in " << seconds << " s" << std::endl;
+    std::cout << "failed statements: " << failures.load() << ", out of order values: " << backwards.load() << std::endl;
+    return failures.load()==0 && backwards.load()==0 ? 0 : 1;
 }
-
-// read and evaluate: 1   1+2.5   1+2+3.14  etc.
-// 	 return the sum (or difference)
-double expression()
+#else
+// usage: calculator [-e 'expr; expr;' | --batch] [--max-ops N] [--timeout-ms N] [--threads N] [--replay FILE] [--journal FILE] [--trace file.json] [--trace-sample N]
+int main(int argc, char* argv[])
 {
-    double left = term();    // get the Term
-    while (true)
-    {
-        token t = ts.get();    // get the next token…
-        switch (t.kind())      // ... and do the right thing with it
-        {
-        case '+':
-            left += term();
-            break;
-        case '-':
-            left -= term();
-            break;
-        default:
-            ts.putback(t);    // <<< put the unused token back
-            return left;      // return the value of the expression
-        }
-    }
-}
-
-void clean_up_mess()
-{
-    ts.ignore(print); 
-}
-
-// definitions of helper functions
-
-// small helper function return all lowercase equivalent of str
-const std::string lowcase(const std::string str){
-    std::string lresult;                // result string to build
-    char ch;
-    for (int i=0; i<str.size();i++)
-    {
-        ch=str[i];
-        if (isalpha(ch))
-            ch = tolower(ch);
-        lresult.push_back(ch);
-    }
-    const std::string out = lresult;
-    return out;
-}
-
-// small helper function to assist peek checking, 
-// true if ch is not an operator, false if it is
-bool is_op(const char ch){
-    for (int i=0; i<NUM_OP; i++)
-    {
-        if (ch==operators[i])
-            return true;
-    }
-    return false;    
-}
-
-// small helper function to determine if a variable is a system constant
-// true if varName is a system constant
-bool is_sysvar(const std::string varName){
-    for (int i=0; i<NUM_SYSVAR; i++)
-    {
-        if (varName==reservedVarNames[i])       // cycle through sysvar portion of reserved
-            return true;
-    }
-    return false;
-}
-
-// small helper function to return value of system constant
-// expects you've checked that is_sysvar, will throw error if not is_sysvar
-const double get_sysvar(const std::string varName){
-    for (int i=0; i<NUM_SYSVAR; i++)
-    {
-        if (varName==reservedVarNames[i])       // cycle through sysvar portion of reserved
-            return syscons[i];
-    }
-    // only get here if it's not a system var
-    throw std::runtime_error(std::string("Attempted to get non-existant system constant ")+varName);
-}
-
-// small helper function to determine if a variable is a protected command
-// true if varName is a protected command, false otherwise
-bool is_command(const std::string varName){
-    int offset = NUM_SYSVAR;
-    for (int i=0; i<NUM_COMMAND; i++)
-    {
-        if (varName==reservedVarNames[offset+i])  // cycle through command portion of reserved
-            return true;
-    }
-    return false;
-}
-
-// small helper function to determine if a variable is a protected option/target
-// true if varName is a valid option/target, false otherwise
-bool is_option(const std::string varName){
-    int offset = NUM_SYSVAR+NUM_COMMAND;
-    for (int i=0; i<NUM_OPTIONS; i++)
-    {
-        if (varName==reservedVarNames[offset+i])  // cycle through option portion of reserved
-            return true;
-    }
-    return false;
-}
-
-// small helper function to return proper flag value
-const double get_option(const std::string varName){
-    int offset = NUM_SYSVAR+NUM_COMMAND;
-    for (int i=0; i<NUM_OPTIONS; i++)
-    {
-        if (varName==reservedVarNames[offset+i])  // cycle through option portion of reserved
+    std::string tracefile;      // empty when not tracing
+    long long tracesample = 1;
+    const char* oneshot = nullptr;  // -e statements, nullptr for the interactive loop
+    bool batch = false;             // pipelined, promptless run over all of std::cin
+    calc_budget budget = {0, std::chrono::nanoseconds(0)};     // per-statement limits, 0 for none
+    unsigned threads = 0;           // for reductions, 0 for one per hardware thread
+    std::string replayfile;         // journal to restore the variables from first, empty for none
+    std::string journalfile;        // journal to log variable changes to, empty for none
+    for (int i=1; i<argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg=="-e" && i+1<argc)
+            oneshot = argv[++i];
+        else if (arg=="--batch")
+            batch = true;
+        else if (arg=="--max-ops" && i+1<argc)
+            budget.max_ops = strtoull(argv[++i], nullptr, 10);
+        else if (arg=="--timeout-ms" && i+1<argc)
+            budget.time = std::chrono::milliseconds(atoll(argv[++i]));
+        else if (arg=="--threads" && i+1<argc)
+            threads = atoi(argv[++i]);
+        else if (arg=="--replay" && i+1<argc)
+            replayfile = argv[++i];
+        else if (arg=="--journal" && i+1<argc)
+            journalfile = argv[++i];
+        else if (arg=="--trace" && i+1<argc)
+            tracefile = argv[++i];
+        else if (arg=="--trace-sample" && i+1<argc)
+            tracesample = atoll(argv[++i]);
+        else
         {
-            const double flag = pow(2,i);
-            return flag;
+            std::cerr << "usage: calculator [-e 'expr; expr;' | --batch] [--max-ops N] [--timeout-ms N] [--threads N] [--replay FILE] [--journal FILE] [--trace file.json] [--trace-sample N]\n";
+            return 1;
         }
     }
-    // fail condition
-    return 0;
-}
-
-// small helper to check if variable is an existing user variable
-// returns true if it is, false if it isn't
-bool is_usrvar(const std::string varName){
-    int select = -1;
-    for (int i=0; i<vecUserVars.size(); i++)
+    try
     {
-        if (vecUserVars[i].sname()==varName)
+        shared_namespace<calc_num> shared;      // lets publish work in the console too
+        calculator<calc_num> calc;
+        calc.set_shared(&shared);
+        calc.set_budget(budget);
+        calc.set_threads(threads);
+        calc.set_cancel(&interrupted);
+        std::signal(SIGINT, on_interrupt);
+        if (!replayfile.empty())    // before the journal is attached, so the restored changes aren't logged again
         {
-            select = i;
-            break;
+            try
+            {
+                unsigned long long n = calc.replay(replayfile);
+                if (oneshot==nullptr && !batch)
+                    std::cout << "Replayed " << n << " changes from " << replayfile << std::endl;
+            }
+            catch (std::runtime_error const& e)
+            {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
         }
-    }
-    if (select!=-1)  // found
-        return true;
-    else
-        return false;
-}
-
-// small helper to get existing user variable value
-// error if not in user variables
-const double get_usrvar(const std::string varName){
-    double result;
-    int select = -1;
-    for (int i=0; i<vecUserVars.size(); i++)
-    {
-        if (vecUserVars[i].sname()==varName)
+        std::unique_ptr<session_journal> journal;   // written out when it goes out of scope
+        if (!journalfile.empty())
         {
-            select = i;
-            break;
-        }
-    }
-    if (select<0)
-        throw std::runtime_error(std::string("Tried to access non-existant user var ")+varName);
-    else
-    {
-        result = vecUserVars[select].getvalue();
-        return result;
-    }
-}
-
-// small helper function to tell if character is a break character ';' '\n' EOF '\0' ' '
-bool is_break(const char ch){
-    return (ch==';' || ch=='\n' || ch==EOF );
-}
-
-
-
-void calculate()
-{
-    while (std::cin)
-    {
-        try        
-        {
-            std::cout << prompt;    // print prompt
-            token t = ts.get();
-            // first discard all “prints”
-            while (t.kind() == print)
-                t = ts.get();
-
-            switch (t.kind())
+            try
             {
-                case quit:
-                {
-                    return;    // ‘q’ or “quit”
-                }
-                case help:     // print help message
-                {
-                    std::cout << std::endl << helptext << std::endl;
-                    break;
-                }
-                case disp:   // command to display something
-                {
-                    int flag = 0;   //get int to switch based off flags, adjust for float precision
-                    flag += t.value();
-                    switch (flag)
-                    {
-                        case DISP_SYS_FLAG:
-                        {
-                            std::cout << "Displaying system constants:" << std::endl;
-                            for (int i=0; i<NUM_SYSVAR; i++)
-                            {
-                                std::cout << "Constant name: " << reservedVarNames[i] << " = " << syscons[i] <<std::endl;
-                            }
-                            break;
-                        }
-                        case DISP_USER_FLAG:
-                        {
-                            int uvsize = vecUserVars.size();
-                            if (uvsize==0)      // no user variables
-                            {
-                                std::cout << "No user variables to display." << std::endl;
-                                break;
-                            }
-                            std::cout << "Displaying all " << uvsize << " user variables:" << std::endl;
-                            for (int i=0; i<uvsize; i++)
-                            {
-                                std::cout << "Variable name: " << vecUserVars[i].sname() << " = " << vecUserVars[i].getvalue() << std::endl;
-                            }
-                            break;
-                        }
-                        case DISP_ALL_FLAG:
-                        {
-                            std::cout << "Displaying all system constants, then all user variables..." << std::endl;
-                            std::cout << "Displaying system constants:" << std::endl;
-                            for (int i=0; i<NUM_SYSVAR; i++)
-                            {
-                                std::cout << "Constant name: " << reservedVarNames[i] << " = " << syscons[i] <<std::endl;
-                            }
-                            int uvsize = vecUserVars.size();
-                            if (uvsize==0)      // no user variables
-                            {
-                                std::cout << "No user variables to display." << std::endl;
-                                break;
-                            }
-                            std::cout << "Displaying all " << uvsize << " user variables:" << std::endl;
-                            for (int i=0; i<uvsize; i++)
-                            {
-                                std::cout << "Variable name: " << vecUserVars[i].sname() << " = " << vecUserVars[i].getvalue() << std::endl;
-                            }
-                            break;
-                        }
-                        case DISP_OP_FLAG:
-                        {
-                            std::cout << "Displaying valid operators:" << std::endl;
-                            for (int i=0; i<NUM_OP; i++)
-                                std::cout << operators[i] << " : " << opdescrip[i] << std::endl;
-                            break;
-                        }
-                        default:
-                            throw std::runtime_error("Invalid display code for display command.");
-                    }
-                    break;
-                }
-                case del:
-                {
-                    if (t.value()==DELETE_ALL)
-                    {
-                        vecUserVars.clear();
-                        std::cout << "Cleared all user variables." << std::endl;
-                        break;
-                    }
-                    int select = -1;
-                    for (int i=0; i<vecUserVars.size(); i++)
-                    {
-                        if (vecUserVars[i].sname()==t.getname())
-                        {
-                            select = i;
-                            break;
-                        }
-                    }
-                    if (select<0)
-                        throw std::runtime_error("Invalid target name for deletion");
-                    std::string delname = vecUserVars[select].sname();
-                    vecUserVars.erase(vecUserVars.begin()+select);
-                    std::cout << "Succesfully erased variable " << delname << std::endl;
-                    break;
-                }
-                case setvar:
-                {   
-                    int assign = t.value();
-                    std::string vname = t.getname();
-                    if (assign==0)  // create new var and set to zero
-                    {
-                        if (is_usrvar(vname)) //already exists
-                        {
-                            throw std::runtime_error(std::string("Tried to create an existing variable")+vname);
-                            break;
-                        }
-                        else     // create and zero var
-                        {
-                            UserVar *uv = new UserVar(vname,0);
-                            vecUserVars.push_back(*uv);
-                            std::cout << "Created new user variable " << vname << " with value 0." << std::endl;
-                            break;
-                        }
-                    }
-                    if (assign==1)  // assign with following expression
-                    {
-                        int select = -1;
-                        for (int i=0;i<vecUserVars.size();i++)
-                        {
-                            if (vecUserVars[i].sname()==t.getname())
-                            {
-                                select = i;
-                                break;
-                            }
-                        }
-                        if (select<0)   // varname doesn't yet exist, get value then create it
-                        {   
-                            double dval = expression();
-                            UserVar *uv = new UserVar(vname,dval);
-                            vecUserVars.push_back(*uv);
-                            std::cout << "Created new user variable " << vname << " with value " << dval << std::endl;
-                            break;
-                        }
-                        else    // existing var, replace value
-                        {
-                            double oldval = vecUserVars[select].getvalue();
-                            double newval = expression();
-                            vecUserVars[select].setvalue(newval);
-                            std::cout << "User variable " << vname << " updated, was " << oldval << ", now " << vname << " = " << newval << std::endl;
-                            break;
-                        }
-                    }
-                    // only here for invalid assign set, throw error
-                    throw std::runtime_error("Invalid setvar assign value, must be 0 or 1");
-                }
-                // all these are acceptable starts to expression
-                case '(':   
-                case '-':
-                case number:
-                {
-                    ts.putback(t);
-                    std::cout << result << expression() << std::endl;
-                    break;
-                }
-                default:
-                    throw std::runtime_error("No matching kind for token");
+                journal.reset(new session_journal(journalfile, sizeof(calc_num)));
             }
+            catch (std::runtime_error const& e)
+            {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            calc.set_journal(journal.get());
         }
-        catch (std::runtime_error const& e)
+        if (tracefile.empty())
         {
-            std::cerr << e.what() << std::endl;    // write error message
-            clean_up_mess();                       // <<< The tricky part!
+            if (oneshot!=nullptr)
+                return run_once(calc, oneshot);
+            if (batch)
+                return run_batch(calc);
+            calculate(calc);
+            return 0;
         }
-    }
-}
-
-int main()
-{
-    try
-    {
-        calculate();
-        return 0;
+        offset_buf counted(std::cin.rdbuf());   // lets tellg() report offsets on pipes too
+        std::streambuf* oldin = std::cin.rdbuf(&counted);
+        session_tracer tracer(65536, tracesample);
+        calc.set_tracer(&tracer);
+        int rc = 0;
+        if (oneshot!=nullptr)
+            rc = run_once(calc, oneshot);
+        else if (batch)
+            rc = run_batch(calc);
+        else
+            calculate(calc);
+        std::cin.rdbuf(oldin);
+        std::ofstream out(tracefile);
+        tracer.dump(out);
+        if (!out)
+        {
+            std::cerr << "could not write trace to " << tracefile << std::endl;
+            return 1;
+        }
+        return rc;
     }
     catch (...)
     {
@@ -970,3 +440,4 @@ int main()
         return 2;
     }
 }
+#endif
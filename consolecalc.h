@@ -0,0 +1,75 @@
+/* C interface to the calculator engine, for embedding it in-process instead of
+   piping text through the calculator binary. Link against libconsolecalc. */
+#ifndef CONSOLECALC_H
+#define CONSOLECALC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* return codes */
+#define CALC_OK           0     /* success */
+#define CALC_ERR_EVAL     1     /* a statement failed to lex, parse or evaluate, see calc_last_error() */
+#define CALC_ERR_NOVAR    2     /* no user variable with that name */
+#define CALC_ERR_NAME     3     /* not a usable user variable name (alpha characters only, not reserved) */
+#define CALC_ERR_ARG      4     /* null context or argument */
+#define CALC_ERR_INTERNAL 5     /* unexpected failure inside the engine */
+#define CALC_ERR_BUDGET   6     /* a statement went over its operation or time budget */
+#define CALC_ERR_CANCELLED 7    /* a statement was stopped by calc_cancel() */
+
+typedef struct calc_context calc_context;   /* one session: user variables and state */
+
+calc_context* calc_create(void);                /* returns NULL on allocation failure */
+void calc_destroy(calc_context* ctx);
+
+/* namespace of constants published with 'publish name = (expr);', shared by every context attached to it.
+   Lookups from any number of threads never block. Destroy it only after detaching every context */
+typedef struct calc_shared calc_shared;
+
+calc_shared* calc_shared_create(void);
+void calc_shared_destroy(calc_shared* sh);
+int calc_set_shared(calc_context* ctx, calc_shared* sh);    /* attach ctx, NULL detaches */
+
+/* evaluate every statement in src, e.g. "x = (2); x*pi;". The trailing ';' is optional.
+   result, if not NULL, gets the value of the last expression or assignment.
+   Returns CALC_OK, or the code of the first failing statement, later statements still run */
+int calc_eval(calc_context* ctx, const char* src, double* result);
+
+/* calc_eval() on each of count strings in order, results and codes are arrays of count entries
+   (either may be NULL). results[i] is NaN for a string that failed or had no expression or assignment.
+   Returns the number of strings that failed */
+size_t calc_eval_batch(calc_context* ctx, const char* const* srcs, size_t count, double* results, int* codes);
+
+/* limits applied to each statement, 0 for no limit. Over budget statements fail with CALC_ERR_BUDGET
+   and evaluation carries on with the next statement */
+int calc_set_budget(calc_context* ctx, unsigned long long max_ops, double timeout_ms);
+
+/* threads sum(), prod(), min() and max() may split a long range over, 0 (the default) for one per
+   hardware thread. Results are the same for any number of threads */
+int calc_set_threads(calc_context* ctx, unsigned threads);
+
+/* stop the statement ctx is running with CALC_ERR_CANCELLED, safe to call from another thread
+   or a signal handler. Has no effect when no statement is running */
+void calc_cancel(calc_context* ctx);
+
+/* log every change to ctx's user variables to the journal file at path, appending if it exists (NULL stops).
+   Writes are group committed, reaching the disk within about 10 ms of the statement. Returns CALC_ERR_EVAL
+   with calc_last_error() set if the file can't be opened */
+int calc_set_journal(calc_context* ctx, const char* path);
+
+/* apply the changes recorded in the journal at path to ctx's user variables, without running statements */
+int calc_replay(calc_context* ctx, const char* path);
+
+int calc_get_var(calc_context* ctx, const char* name, double* value);
+int calc_set_var(calc_context* ctx, const char* name, double value);   /* creates the variable if needed */
+
+/* message of the last error on ctx, "" if none. Valid until the next call on ctx */
+const char* calc_last_error(const calc_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONSOLECALC_H */
@@ -0,0 +1,445 @@
+
+// Workload generator and throughput regression harness for the calculator
+//
+// workload gen [--seed N] [--count N]
+//     writes a deterministic mix of statements to std::cout: assignments, variable heavy and deeply
+//     nested expressions, function calls, reductions, deletes and malformed lines. There are no display
+//     commands, --batch doesn't write listings
+// workload bench --calculator PATH [--seed N] [--count N] [--runs N] [--baseline FILE] [--threshold PCT] [--save]
+//     pipes the mix through 'PATH --batch' --runs times (5) and reports the median run's statements per second
+//     and peak RSS, and p50/p99 statement latency from one more traced run. Compares against the baseline file,
+//     exit status 1 if throughput fell by more than the threshold percentage. With --save, or when the baseline
+//     file doesn't exist yet, records it instead
+//
+// Build: g++ -std=c++20 -O2 workload.cpp -o workload
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Generator stuff
+const unsigned NAME_POOL = 2000;       // distinct user variable names the mix draws from
+const unsigned TRACE_SPANS = 65536;    // statements the calculator's tracer keeps
+
+// the same seed gives the same workload everywhere: mt19937_64 is fully specified but the standard
+// distributions aren't, so draws are reduced with plain modulo
+class workload_rng
+{
+    std::mt19937_64 gen;
+
+public:
+    explicit workload_rng(uint64_t seed)
+      : gen(seed)
+    {
+    }
+    unsigned below(unsigned n)
+    {
+        return gen()%n;
+    }
+    bool chance(unsigned percent)
+    {
+        return below(100)<percent;
+    }
+};
+
+class workload_gen
+{
+    workload_rng rng;
+    std::vector<std::string> live;      // user variables that exist at this point of the session
+    char const* ops = "+-*/";
+
+    // user variable names must be alpha only, the 'v' keeps them clear of sysvars, commands and functions
+    static std::string var_name(unsigned i)
+    {
+        std::string name = "v";
+        do
+        {
+            name.push_back('a'+i%26);
+            i /= 26;
+        } while (i!=0);
+        return name;
+    }
+    std::string number()
+    {
+        return std::to_string(rng.below(1000))+"."+std::to_string(rng.below(100));
+    }
+    std::string operand()
+    {
+        unsigned pick = rng.below(10);
+        if (pick<6 && !live.empty())
+            return live[rng.below(live.size())];
+        if (pick==6)
+            return rng.chance(50) ? "pi" : "e";
+        return number();
+    }
+    // a chain of operands, mostly variables
+    std::string flat(unsigned n)
+    {
+        std::string s = operand();
+        for (unsigned i=1; i<n; i++)
+        {
+            s.push_back(ops[rng.below(4)]);
+            s += operand();
+        }
+        return s;
+    }
+    std::string nested(unsigned depth)
+    {
+        if (depth==0)
+            return operand();
+        return "("+nested(depth-1)+ops[rng.below(4)]+operand()+")";
+    }
+    std::string assignment()
+    {
+        std::string name = var_name(rng.below(NAME_POOL));
+        // kept to small sums so the values stay in a sane range over a long session
+        std::string s = operand()+(rng.chance(50) ? "+" : "-")+number();
+        if (rng.chance(30))
+            s += "*0."+std::to_string(1+rng.below(9));
+        if (std::find(live.begin(), live.end(), name)==live.end())
+            live.push_back(name);   // only after the operands, a new variable can't be read in its own assignment
+        return name+" = ("+s+");";
+    }
+    std::string malformed()
+    {
+        switch (rng.below(6))
+        {
+            // none of them creates a variable or runs into the next line, so live stays right
+            case 0: return var_name(rng.below(NAME_POOL))+" = ("+operand()+" + * "+operand()+");";
+            case 1: return "("+flat(3)+"));";
+            case 2: return operand()+" + * "+operand()+";";
+            case 3: return number()+" $ "+number()+";";
+            case 4: return "nosuchvar + "+number()+";";
+            default: return "display nothing;";
+        }
+    }
+    // listings aren't in the mix, --batch doesn't write them so they would only time the parse
+    std::string command()
+    {
+        if (live.empty())
+            return assignment();
+        size_t i = rng.below(live.size());
+        std::string s = "delete "+live[i]+";";
+        live[i] = live.back();
+        live.pop_back();
+        return s;
+    }
+
+public:
+    explicit workload_gen(uint64_t seed)
+      : rng(seed)
+    {
+    }
+
+    // the whole session, count statements after the function definitions, one per line
+    std::string session(unsigned long count)
+    {
+        std::string out = "def sq(x) = (x*x);\ndef lerp(x,y,t) = (x+(y-x)*t);\ndef poly(x) = (((2.5*x-1.5)*x+0.75)*x-3);\n";
+        for (unsigned long i=0; i<count; i++)
+        {
+            unsigned pick = rng.below(100);
+            if (pick<30)
+                out += assignment();
+            else if (pick<60)
+                out += flat(4+rng.below(9))+";";
+            else if (pick<72)
+                out += nested(8+rng.below(17))+";";
+            else if (pick<82)
+            {
+                switch (rng.below(3))
+                {
+                    case 0: out += "sq("+operand()+")+"+operand()+";"; break;
+                    case 1: out += "lerp("+operand()+", "+operand()+", 0.25);"; break;
+                    default: out += "poly("+operand()+");"; break;
+                }
+            }
+            else if (pick<85)
+                out += "sum(i, 1, "+std::to_string(10+rng.below(90))+", i*"+operand()+");";
+            else if (pick<93)
+                out += malformed();
+            else
+                out += command();
+            out.push_back('\n');
+        }
+        return out;
+    }
+};
+
+// Harness stuff
+struct run_stats
+{
+    double seconds;     // wall time of the whole run
+    long peakRssKb;
+    bool ok;            // exited on its own, failed statements still count as ok
+};
+
+// run calculator with args, stdin from the file at input and its output discarded
+run_stats run_calculator(const std::string& calculator, const std::vector<std::string>& args, const std::string& input)
+{
+    run_stats st = {0, 0, false};
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid<0)
+        return st;
+    if (pid==0)
+    {
+        int in = open(input.c_str(), O_RDONLY);
+        int null = open("/dev/null", O_WRONLY);
+        if (in<0 || null<0)
+            _exit(127);
+        dup2(in, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(calculator.c_str()));
+        for (size_t i=0; i<args.size(); i++)
+            argv.push_back(const_cast<char*>(args[i].c_str()));
+        argv.push_back(nullptr);
+        execv(calculator.c_str(), argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage)<0)
+        return st;
+    st.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    st.peakRssKb = usage.ru_maxrss;     // kilobytes on Linux
+    st.ok = WIFEXITED(status) && WEXITSTATUS(status)<=1;    // 1 only means some statement failed
+    return st;
+}
+
+// durations in microseconds of the statement spans in a trace written by --trace
+std::vector<double> trace_durations(const std::string& path)
+{
+    std::ifstream in(path);
+    std::stringstream buf;
+    buf << in.rdbuf();
+    std::string trace = buf.str();
+    std::vector<double> durs;
+    char const key[] = "{\"name\":\"statement\"";
+    for (size_t pos = trace.find(key); pos!=std::string::npos; pos = trace.find(key, pos+1))
+    {
+        size_t dur = trace.find("\"dur\":", pos);
+        if (dur==std::string::npos)
+            break;
+        durs.push_back(strtod(trace.c_str()+dur+6, nullptr));
+    }
+    return durs;
+}
+
+double percentile(std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)(p*(sorted.size()-1)+0.5);
+    return sorted[rank];
+}
+
+// the baseline file holds one "key value" pair per line, # starts a comment. Values are kept as text so
+// the seed and statement count compare exactly, the measurements are parsed where they are compared
+std::map<std::string, std::string> read_baseline(const std::string& path)
+{
+    std::map<std::string, std::string> vals;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0]=='#')
+            continue;
+        std::istringstream fields(line);
+        std::string key, v;
+        if (fields >> key >> v)
+            vals[key] = v;
+    }
+    return vals;
+}
+
+// seed and statements are written as integers, the measurements with enough digits to read back unchanged
+bool write_baseline(const std::string& path, uint64_t seed, unsigned long count, const std::map<std::string, double>& vals)
+{
+    std::ofstream out(path);
+    out << "# calculator throughput baseline, written by 'workload bench --save'\n";
+    out << "seed " << seed << '\n' << "statements " << count << '\n';
+    out << std::setprecision(17);
+    for (auto it=vals.begin(); it!=vals.end(); ++it)
+        out << it->first << ' ' << it->second << '\n';
+    return bool(out);
+}
+
+// the temporary directory bench() runs in, removed with the session and trace in it however bench() returns
+struct scratch_dir
+{
+    std::string path;   // empty if it couldn't be made
+    std::string input;
+    std::string trace;
+
+    scratch_dir()
+    {
+        char dir[] = "/tmp/workloadXXXXXX";
+        if (mkdtemp(dir)==nullptr)
+            return;
+        path = dir;
+        input = path+"/session.txt";
+        trace = path+"/trace.json";
+    }
+    ~scratch_dir()
+    {
+        if (path.empty())
+            return;
+        unlink(input.c_str());
+        unlink(trace.c_str());
+        rmdir(path.c_str());
+    }
+    scratch_dir(const scratch_dir&) = delete;
+    scratch_dir& operator=(const scratch_dir&) = delete;
+};
+
+int bench(const std::string& calculator, uint64_t seed, unsigned long count, int runs, const std::string& baseline, double threshold, bool save)
+{
+    scratch_dir dir;
+    if (dir.path.empty())
+    {
+        std::cerr << "could not create a temporary directory\n";
+        return 2;
+    }
+    const std::string& input = dir.input;
+    const std::string& trace = dir.trace;
+    {
+        std::ofstream out(input);
+        out << workload_gen(seed).session(count);
+    }
+
+    // throughput and memory from untraced runs, the median one so a single lucky or unlucky run can't move the gate
+    std::vector<run_stats> all;
+    for (int i=0; i<runs; i++)
+    {
+        run_stats st = run_calculator(calculator, {"--batch"}, input);
+        if (!st.ok)
+        {
+            std::cerr << "calculator run failed: " << calculator << "\n";
+            return 2;
+        }
+        all.push_back(st);
+    }
+    std::sort(all.begin(), all.end(), [](const run_stats& a, const run_stats& b) { return a.seconds<b.seconds; });
+    run_stats median = all[all.size()/2];
+    // latency from one traced run, sampled so the kept spans cover the whole session
+    unsigned long sample = (count+TRACE_SPANS-1)/TRACE_SPANS;
+    run_stats traced = run_calculator(calculator, {"--batch", "--trace", trace, "--trace-sample", std::to_string(sample)}, input);
+    std::vector<double> durs = trace_durations(trace);
+    if (!traced.ok || durs.empty())
+    {
+        std::cerr << "traced calculator run failed or wrote no spans: " << calculator << "\n";
+        return 2;
+    }
+    std::sort(durs.begin(), durs.end());
+
+    std::map<std::string, double> now;
+    now["statements_per_sec"] = count/median.seconds;
+    now["p50_us"] = percentile(durs, 0.50);
+    now["p99_us"] = percentile(durs, 0.99);
+    now["peak_rss_kb"] = median.peakRssKb;
+    std::cout << "statements:         " << count << " (seed " << seed << ")\n"
+              << "statements per sec: " << now["statements_per_sec"] << "\n"
+              << "p50 latency:        " << now["p50_us"] << " us\n"
+              << "p99 latency:        " << now["p99_us"] << " us\n"
+              << "peak RSS:           " << median.peakRssKb << " KB\n";
+
+    std::map<std::string, std::string> base = read_baseline(baseline);
+    if (save || base.empty())
+    {
+        if (!write_baseline(baseline, seed, count, now))
+        {
+            std::cerr << "could not write baseline " << baseline << "\n";
+            return 2;
+        }
+        std::cout << "baseline saved to " << baseline << "\n";
+        return 0;
+    }
+    if (base["seed"]!=std::to_string(seed) || base["statements"]!=std::to_string(count))
+    {
+        std::cerr << "baseline " << baseline << " was recorded with another seed or statement count\n";
+        return 2;
+    }
+    char const* keys[] = {"statements_per_sec", "p50_us", "p99_us", "peak_rss_kb"};
+    for (size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++)
+    {
+        double was = strtod(base[keys[i]].c_str(), nullptr);
+        double change = was!=0 ? (now[keys[i]]-was)/was*100 : 0;
+        std::cout << keys[i] << ": " << was << " -> " << now[keys[i]] << " (" << (change>=0 ? "+" : "") << change << "%)\n";
+    }
+    double floor = strtod(base["statements_per_sec"].c_str(), nullptr)*(1-threshold/100);
+    if (now["statements_per_sec"]<floor)
+    {
+        std::cout << "FAIL: throughput fell more than " << threshold << "% below the baseline\n";
+        return 1;
+    }
+    std::cout << "ok\n";
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    char const usage[] = "usage: workload gen [--seed N] [--count N]\n"
+                         "       workload bench --calculator PATH [--seed N] [--count N] [--runs N] [--baseline FILE] [--threshold PCT] [--save]\n";
+    if (argc<2)
+    {
+        std::cerr << usage;
+        return 2;
+    }
+    std::string mode = argv[1];
+    uint64_t seed = 1;
+    unsigned long count = 200000;
+    int runs = 5;
+    std::string calculator;
+    std::string baseline = "workload.baseline";
+    double threshold = 10;
+    bool save = false;
+    for (int i=2; i<argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg=="--seed" && i+1<argc)
+            seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg=="--count" && i+1<argc)
+            count = strtoul(argv[++i], nullptr, 10);
+        else if (arg=="--runs" && i+1<argc)
+            runs = std::max(1, atoi(argv[++i]));
+        else if (arg=="--calculator" && i+1<argc)
+            calculator = argv[++i];
+        else if (arg=="--baseline" && i+1<argc)
+            baseline = argv[++i];
+        else if (arg=="--threshold" && i+1<argc)
+            threshold = atof(argv[++i]);
+        else if (arg=="--save")
+            save = true;
+        else
+        {
+            std::cerr << usage;
+            return 2;
+        }
+    }
+    if (mode=="gen")
+    {
+        std::cout << workload_gen(seed).session(count);
+        return 0;
+    }
+    if (mode=="bench" && !calculator.empty() && count>0)
+        return bench(calculator, seed, count, runs, baseline, threshold, save);
+    std::cerr << usage;
+    return 2;
+}